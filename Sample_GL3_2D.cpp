@@ -1,7 +1,29 @@
 #include <iostream>
+#include <new>
 #include <cmath>
 #include <fstream>
+#include <iomanip>
 #include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <time.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
@@ -13,17 +35,628 @@
 
 using namespace std;
 
+/* Allocation tracking. Every operator new is counted for the calling
+   thread, so frames and profiler zones can tell what they allocated.
+   With --assert-no-alloc, an allocation inside a NoAllocScope aborts :
+   the steady state frame loop runs in one once warmed up, which keeps
+   it allocation free. AllowAllocScope exempts diagnostics (traces and
+   flight records) from the check. Only operator new is hooked, which
+   covers new and the standard containers : malloc and realloc calls,
+   from C code and the GL driver, are neither counted nor checked. */
+struct AllocCounters {
+	unsigned long long Count;
+	unsigned long long Bytes;
+	int NoAlloc; // NoAllocScope depth
+	int Allowed; // AllowAllocScope depth, overrides NoAlloc
+};
+
+static thread_local AllocCounters threadAllocs; // plain data : using it never allocates
+bool assert_no_alloc = false;
+
+#define ALLOC_WARMUP_FRAMES 120 // frames before the loop must stop allocating
+
+void* operator new (size_t size)
+{
+	AllocCounters& allocs = threadAllocs;
+	allocs.Count++;
+	allocs.Bytes += size;
+	if (assert_no_alloc && allocs.NoAlloc > 0 && allocs.Allowed == 0) {
+		// No iostream here, it could allocate again
+		fprintf(stderr, "Allocation of %lu bytes in the steady state frame loop\n", (unsigned long) size);
+		abort();
+	}
+	void* memory = malloc(size > 0 ? size : 1);
+	if (memory == NULL)
+		throw std::bad_alloc();
+	return memory;
+}
+
+void operator delete (void* memory) noexcept
+{
+	free(memory);
+}
+
+void operator delete (void* memory, size_t) noexcept
+{
+	free(memory);
+}
+
+struct NoAllocScope {
+	bool Active;
+	NoAllocScope (bool active) : Active(active) { if (Active) threadAllocs.NoAlloc++; }
+	~NoAllocScope () { if (Active) threadAllocs.NoAlloc--; }
+};
+
+struct AllowAllocScope {
+	AllowAllocScope () { threadAllocs.Allowed++; }
+	~AllowAllocScope () { threadAllocs.Allowed--; }
+};
+
+/* Scoped CPU profiler. PROFILE_ZONE("name") times the rest of the
+   enclosing block on the calling thread. Zones are only recorded while
+   profiler.Enabled is set, otherwise a zone costs one relaxed load.
+   writeChromeTrace() dumps what was recorded as Chrome trace_event JSON,
+   which chrome://tracing and Perfetto open; nested zones show as a stack. */
+struct ProfileEvent {
+	const char* Name; // string literal
+	long long Start;  // steady_clock ns
+	long long End;
+	unsigned int Allocs; // allocations made by the thread inside the zone
+	unsigned long long AllocBytes;
+};
+
+/* Value sampled at a point in time, drawn as a graph in the trace */
+struct ProfileCounter {
+	const char* Name; // string literal
+	long long Time;
+	double Value;
+	const char* Unit; // shown as the series name
+};
+
+struct ProfileThread {
+	std::mutex Lock; // uncontended except while a trace is written
+	vector<ProfileEvent> Events;
+	vector<ProfileCounter> Counters;
+	size_t NextEvent, NextCounter; // oldest entries once the ring wrapped
+	const char* Name;
+	int Id;
+};
+
+struct Profiler {
+	static const size_t MAX_EVENTS = 1 << 18;  // per thread in a capture, further zones are only counted in Dropped
+	static const size_t RING_EVENTS = 1 << 14; // per thread kept for the flight recorder
+
+	std::atomic<bool> Enabled;      // zones are recorded
+	std::atomic<bool> Capturing;    // into a capture started by startProfiling, else into the flight recorder ring
+	bool Ring;                      // the flight recorder wants zones while there is no capture
+	std::mutex Lock;                // guards Threads
+	vector<ProfileThread*> Threads; // never freed, a thread may exit before the trace is written
+	std::atomic<unsigned int> Dropped;
+	long long Origin;               // time 0 of the trace
+} profiler;
+
+long long profileNow ()
+{
+	return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* Buffer of the calling thread, registered on first use */
+ProfileThread& profileThread ()
+{
+	static thread_local ProfileThread* thread = NULL;
+	if (thread == NULL) {
+		thread = new ProfileThread;
+		thread->Name = NULL;
+		thread->NextEvent = thread->NextCounter = 0;
+		std::lock_guard<std::mutex> lock(profiler.Lock);
+		thread->Id = profiler.Threads.size() + 1;
+		profiler.Threads.push_back(thread);
+	}
+	return *thread;
+}
+
+/* Name shown for the calling thread in the trace */
+void profileNameThread (const char* name)
+{
+	profileThread().Name = name;
+}
+
+/* A capture keeps everything up to MAX_EVENTS, the flight recorder ring the last RING_EVENTS */
+template <typename T>
+void profileAppend (vector<T>& items, size_t& next, const T& item)
+{
+	if (profiler.Capturing.load(std::memory_order_relaxed)) {
+		if (items.size() >= Profiler::MAX_EVENTS) {
+			profiler.Dropped++;
+			return;
+		}
+		items.push_back(item);
+		return;
+	}
+	if (items.size() < Profiler::RING_EVENTS) {
+		items.push_back(item);
+		return;
+	}
+	items[next] = item;
+	next = (next + 1) % items.size();
+}
+
+void profileRecord (const char* name, long long start, long long end, unsigned int allocs, unsigned long long alloc_bytes)
+{
+	AllowAllocScope allow_alloc; // buffer growth belongs to the profiler, not to the zone
+	ProfileThread& thread = profileThread();
+	std::lock_guard<std::mutex> lock(thread.Lock);
+	ProfileEvent event = { name, start, end, allocs, alloc_bytes };
+	profileAppend(thread.Events, thread.NextEvent, event);
+}
+
+void profileCounter (const char* name, double value, const char* unit = "ms")
+{
+	if (!profiler.Enabled.load(std::memory_order_relaxed))
+		return;
+	AllowAllocScope allow_alloc;
+	ProfileThread& thread = profileThread();
+	std::lock_guard<std::mutex> lock(thread.Lock);
+	ProfileCounter counter = { name, profileNow(), value, unit };
+	profileAppend(thread.Counters, thread.NextCounter, counter);
+}
+
+struct ProfileZone {
+	const char* Name;
+	long long Start; // 0 when the profiler was off as the zone opened
+	unsigned long long Allocs, AllocBytes; // thread counts when the zone opened
+
+	ProfileZone (const char* name) : Name(name), Start(0)
+	{
+		if (profiler.Enabled.load(std::memory_order_relaxed)) {
+			Start = profileNow();
+			Allocs = threadAllocs.Count;
+			AllocBytes = threadAllocs.Bytes;
+		}
+	}
+
+	~ProfileZone ()
+	{
+		if (Start != 0)
+			profileRecord(Name, Start, profileNow(), threadAllocs.Count - Allocs, threadAllocs.Bytes - AllocBytes);
+	}
+};
+
+string trace_path = "trace.json"; // written by the T key and --trace
+
+#define PROFILE_CONCAT2(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT2(a, b)
+#define PROFILE_ZONE(name) ProfileZone PROFILE_CONCAT(profile_zone_, __LINE__)(name)
+
+void clearProfileBuffers ()
+{
+	std::lock_guard<std::mutex> lock(profiler.Lock);
+	for (size_t i=0; i<profiler.Threads.size(); i++) {
+		ProfileThread& thread = *profiler.Threads[i];
+		std::lock_guard<std::mutex> thread_lock(thread.Lock);
+		thread.Events.clear();
+		thread.Counters.clear();
+		thread.NextEvent = thread.NextCounter = 0;
+	}
+}
+
+/* Drop anything recorded so far and start recording zones */
+void startProfiling ()
+{
+	profiler.Capturing = false;
+	clearProfileBuffers();
+	profiler.Dropped = 0;
+	profiler.Origin = profileNow();
+	profiler.Capturing = true;
+	profiler.Enabled = true;
+}
+
+/* Writes Chrome trace_event JSON. Times are steady_clock ns, written in
+   the microseconds Chrome wants, relative to Origin. */
+struct TraceWriter {
+	ofstream Out;
+	bool First;
+	long long Origin;
+
+	bool open (const char* path, long long origin)
+	{
+		Out.open(path);
+		if (!Out) {
+			cerr << "Cannot write trace " << path << endl;
+			return false;
+		}
+		Out << fixed << setprecision(3);
+		Out << "{\"traceEvents\":[" << endl;
+		First = true;
+		Origin = origin;
+		return true;
+	}
+
+	void next ()
+	{
+		Out << (First ? "" : ",\n");
+		First = false;
+	}
+
+	void threadName (int tid, const char* name)
+	{
+		next();
+		Out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << tid
+			<< ",\"args\":{\"name\":\"" << name << "\"}}";
+	}
+
+	void zone (const ProfileEvent& event, int tid)
+	{
+		next();
+		Out << "{\"name\":\"" << event.Name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << tid
+			<< ",\"ts\":" << (event.Start - Origin)/1000.0 << ",\"dur\":" << (event.End - event.Start)/1000.0
+			<< ",\"args\":{\"allocs\":" << event.Allocs << ",\"alloc bytes\":" << event.AllocBytes << "}}";
+	}
+
+	void counter (const char* name, int tid, long long time, double value, const char* unit)
+	{
+		next();
+		Out << "{\"name\":\"" << name << "\",\"ph\":\"C\",\"pid\":1,\"tid\":" << tid
+			<< ",\"ts\":" << (time - Origin)/1000.0 << ",\"args\":{\"" << unit << "\":" << value << "}}";
+	}
+
+	void instant (const char* name, int tid, long long time)
+	{
+		next();
+		Out << "{\"name\":\"" << name << "\",\"ph\":\"i\",\"s\":\"g\",\"pid\":1,\"tid\":" << tid
+			<< ",\"ts\":" << (time - Origin)/1000.0 << "}";
+	}
+
+	void close ()
+	{
+		Out << "\n]}" << endl;
+		Out.close();
+	}
+};
+
+/* Stop the capture and write the zones of every thread to path */
+bool writeChromeTrace (const char* path)
+{
+	AllowAllocScope allow_alloc;
+	profiler.Capturing = false;
+	profiler.Enabled = profiler.Ring;
+
+	TraceWriter trace;
+	if (!trace.open(path, profiler.Origin))
+		return false;
+	{
+		std::lock_guard<std::mutex> lock(profiler.Lock);
+		for (size_t i=0; i<profiler.Threads.size(); i++) {
+			ProfileThread& thread = *profiler.Threads[i];
+			std::lock_guard<std::mutex> thread_lock(thread.Lock);
+			if (thread.Name != NULL)
+				trace.threadName(thread.Id, thread.Name);
+			for (size_t e=0; e<thread.Events.size(); e++)
+				trace.zone(thread.Events[e], thread.Id);
+			for (size_t c=0; c<thread.Counters.size(); c++)
+				trace.counter(thread.Counters[c].Name, thread.Id, thread.Counters[c].Time, thread.Counters[c].Value, thread.Counters[c].Unit);
+		}
+	}
+	trace.close();
+
+	cout << "Trace written to " << path;
+	if (profiler.Dropped > 0)
+		cout << ", " << profiler.Dropped << " zones dropped";
+	cout << endl;
+
+	// The flight recorder ring starts again from what follows
+	if (profiler.Ring)
+		clearProfileBuffers();
+	return true;
+}
+
+/* Hardware performance counters, read with perf_event_open around the
+   simulation tick and the draw list build, on the thread running them.
+   Off unless --perf-counters is given; Linux only. Each section adds
+   its counts per frame to the profiler and to the bench report. */
+enum { HW_CYCLES, HW_INSTRUCTIONS, HW_L1D_MISSES, HW_LLC_MISSES, HW_BRANCH_MISSES, HW_COUNTERS };
+enum { HW_SIM_TICK, HW_DRAW_LIST, HW_SECTIONS };
+
+const char* hw_counter_names[HW_COUNTERS] = { "cycles", "instructions", "L1d misses", "LLC misses", "branch misses" };
+const char* hw_section_names[HW_SECTIONS] = { "sim tick", "draw list" };
+const char* hw_trace_names[HW_SECTIONS][HW_COUNTERS] = {
+	{ "sim tick cycles", "sim tick instructions", "sim tick L1d misses", "sim tick LLC misses", "sim tick branch misses" },
+	{ "draw list cycles", "draw list instructions", "draw list L1d misses", "draw list LLC misses", "draw list branch misses" },
+};
+
+struct HwSectionStats {
+	unsigned long long Total[HW_COUNTERS]; // summed over Samples runs, since resetHwCounters
+	int Samples;
+};
+
+struct HwCounters {
+	bool Enabled;
+	std::atomic<bool> Supported[HW_COUNTERS]; // opened on at least one thread, set from any of them
+	HwSectionStats Sections[HW_SECTIONS]; // each section only runs on one thread at a time
+} hwCounters;
+
+/* perf_event_open group of the calling thread, cycles leading.
+   Its counters are closed when the thread exits. */
+struct HwCounterGroup {
+	bool Tried;
+	int Leader;             // -1 when the counters could not be opened
+	int Fds[HW_COUNTERS];
+	int Slot[HW_COUNTERS];  // position in the group read, -1 if not opened
+	int Count;
+
+	~HwCounterGroup ()
+	{
+#ifdef __linux__
+		for (int c=0; Tried && c<HW_COUNTERS; c++)
+			if (Fds[c] >= 0)
+				close(Fds[c]);
+#endif
+	}
+};
+
+void resetHwCounters ()
+{
+	for (int section=0; section<HW_SECTIONS; section++) {
+		for (int c=0; c<HW_COUNTERS; c++)
+			hwCounters.Sections[section].Total[c] = 0;
+		hwCounters.Sections[section].Samples = 0;
+	}
+}
+
+HwCounterGroup& hwCounterGroup ()
+{
+	static thread_local HwCounterGroup group = { false, -1, {}, {}, 0 };
+	if (group.Tried)
+		return group;
+	group.Tried = true;
+	group.Count = 0;
+	for (int c=0; c<HW_COUNTERS; c++) {
+		group.Fds[c] = -1;
+		group.Slot[c] = -1;
+	}
+#ifdef __linux__
+	static const unsigned int types[HW_COUNTERS] = {
+		PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE
+	};
+	static const unsigned long long configs[HW_COUNTERS] = {
+		PERF_COUNT_HW_CPU_CYCLES,
+		PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+		PERF_COUNT_HW_CACHE_MISSES,
+		PERF_COUNT_HW_BRANCH_MISSES
+	};
+	for (int c=0; c<HW_COUNTERS; c++) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = types[c];
+		attr.config = configs[c];
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP;
+		// pid 0, cpu -1 : this thread on any CPU
+		int fd = syscall(__NR_perf_event_open, &attr, 0, -1, group.Leader, 0);
+		if (fd < 0) {
+			if (c == HW_CYCLES)
+				break; // no leader, no group
+			continue;
+		}
+		if (c == HW_CYCLES)
+			group.Leader = fd;
+		group.Fds[c] = fd;
+		group.Slot[c] = group.Count++;
+		hwCounters.Supported[c] = true;
+	}
+	if (group.Leader < 0)
+		cerr << "perf_event_open failed, no hardware counters on this thread (see /proc/sys/kernel/perf_event_paranoid)" << endl;
+	else
+		ioctl(group.Leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+	return group;
+}
+
+/* One read() of the whole group */
+bool readHwCounters (HwCounterGroup& group, unsigned long long* values)
+{
+#ifdef __linux__
+	unsigned long long data[1 + HW_COUNTERS];
+	if (group.Leader < 0 || read(group.Leader, data, sizeof(data)) < (ssize_t) sizeof(unsigned long long))
+		return false;
+	for (int c=0; c<HW_COUNTERS; c++)
+		values[c] = group.Slot[c] >= 0 ? data[1 + group.Slot[c]] : 0;
+	return true;
+#else
+	return false;
+#endif
+}
+
+/* Counts the hardware events of the rest of the enclosing block into a section */
+struct HwCounterScope {
+	int Section;
+	bool Active;
+	unsigned long long Start[HW_COUNTERS];
+
+	HwCounterScope (int section) : Section(section), Active(false)
+	{
+		if (hwCounters.Enabled)
+			Active = readHwCounters(hwCounterGroup(), Start);
+	}
+
+	~HwCounterScope ()
+	{
+		if (!Active)
+			return;
+		unsigned long long end[HW_COUNTERS];
+		HwCounterGroup& group = hwCounterGroup();
+		if (!readHwCounters(group, end))
+			return;
+		HwSectionStats& stats = hwCounters.Sections[Section];
+		for (int c=0; c<HW_COUNTERS; c++) {
+			if (group.Slot[c] < 0) // not opened on this thread
+				continue;
+			stats.Total[c] += end[c] - Start[c];
+			profileCounter(hw_trace_names[Section][c], end[c] - Start[c], "count");
+		}
+		stats.Samples++;
+	}
+};
+
+/* GPU objects are addressed by generational handles : the index of a slot
+   in the resource manager, and the generation the slot had when the
+   handle was made. Once the object is released the slot generation moves
+   on, so a stale handle resolves to NULL rather than to whatever reuses
+   the slot later. */
+struct ResourceHandle {
+	unsigned int Index;
+	unsigned int Generation; // slots start at generation 1 : a zeroed handle is null
+};
+typedef ResourceHandle MeshHandle;
+const ResourceHandle NO_RESOURCE = { 0, 0 };
+
 struct VAO {
 	GLuint VertexArrayID;
 	GLuint VertexBuffer;
-	GLuint ColorBuffer;
+	GLuint ColorBuffer; // 0 when the colors are interleaved in VertexBuffer
 
 	GLenum PrimitiveMode;
 	GLenum FillMode;
 	int NumVertices;
+	int NumIndices; // drawn through a shared index buffer if not 0, see MeshIndexing
+
+	int Program; // index in renderPrograms of the program that draws this object
+	MeshHandle SdfQuad; // 4 vertex quad drawn by the SDF circle pipeline, NO_RESOURCE if not a circle
+	unsigned int EnabledAttribs; // bit i set once vertex attribute i is enabled, it is part of the VAO state
+
+	// Bounding box of the vertices in model space, for culling
+	float MinX, MinY;
+	float MaxX, MaxY;
 };
 typedef struct VAO VAO;
 
+/* Last GL state set through the state* functions, so redundant calls can be skipped */
+struct GLStateCache {
+	GLuint VertexArray;
+	GLuint Program;
+	GLenum PolygonMode;
+	bool Blend;
+
+	int Issued;      // state calls sent to GL this frame
+	int Elided;      // state calls skipped this frame because nothing changed
+	int LastIssued;  // totals of the previous frame, for reporting
+	int LastElided;
+} glState = { 0, 0, GL_FILL, false, 0, 0, 0, 0 };
+
+/* Work handed to GL, counted where it is issued : draw3DObject,
+   create3DObject, uniform uploads and the stream buffer. Counts are
+   deterministic for a given scene, unlike timings, so render cost
+   regressions show up as plain diffs of these numbers. */
+struct RenderStats {
+	int DrawCalls;
+	int Vertices;            // submitted by the draw calls
+	int StateChanges;        // GL state calls issued through the state cache
+	int UniformUploads;
+	long long BytesUploaded; // vertex data given to GL
+	int Allocations;         // operator new calls on the rendering thread since the previous frame
+	long long AllocatedBytes;
+};
+
+RenderStats frameStats;     // frame being drawn, only touched by the thread owning the context
+RenderStats lastFrameStats; // last complete frame, guarded by renderStatsLock
+std::mutex renderStatsLock;
+
+/* Counts of the last complete frame, callable from any thread */
+RenderStats getRenderStats ()
+{
+	std::lock_guard<std::mutex> lock(renderStatsLock);
+	return lastFrameStats;
+}
+
+void stateBindVertexArray (GLuint vertexArray)
+{
+	if (glState.VertexArray == vertexArray) {
+		glState.Elided++;
+		return;
+	}
+	glBindVertexArray (vertexArray);
+	glState.VertexArray = vertexArray;
+	glState.Issued++;
+}
+
+void stateUseProgram (GLuint program)
+{
+	if (glState.Program == program) {
+		glState.Elided++;
+		return;
+	}
+	glUseProgram (program);
+	glState.Program = program;
+	glState.Issued++;
+}
+
+void statePolygonMode (GLenum mode)
+{
+	if (glState.PolygonMode == mode) {
+		glState.Elided++;
+		return;
+	}
+	glPolygonMode (GL_FRONT_AND_BACK, mode);
+	glState.PolygonMode = mode;
+	glState.Issued++;
+}
+
+void stateBlend (bool enable)
+{
+	if (glState.Blend == enable) {
+		glState.Elided++;
+		return;
+	}
+	if (enable)
+		glEnable (GL_BLEND);
+	else
+		glDisable (GL_BLEND);
+	glState.Blend = enable;
+	glState.Issued++;
+}
+
+/* Enabled attributes are stored in the bound VAO, so they are tracked per VAO */
+void stateEnableAttrib (struct VAO* vao, GLuint index)
+{
+	if (vao->EnabledAttribs & (1u << index)) {
+		glState.Elided++;
+		return;
+	}
+	stateBindVertexArray (vao->VertexArrayID);
+	glEnableVertexAttribArray (index);
+	vao->EnabledAttribs |= (1u << index);
+	glState.Issued++;
+}
+
+/* Close the frame statistics of the state cache */
+void stateEndFrame ()
+{
+	glState.LastIssued = glState.Issued;
+	glState.LastElided = glState.Elided;
+	glState.Issued = 0;
+	glState.Elided = 0;
+}
+
+/* Publish this frame's counts and start the next frame from zero. Called after stateEndFrame */
+void endRenderStatsFrame ()
+{
+	static thread_local unsigned long long allocs_before = 0, alloc_bytes_before = 0;
+	frameStats.StateChanges = glState.LastIssued;
+	frameStats.Allocations = threadAllocs.Count - allocs_before;
+	frameStats.AllocatedBytes = threadAllocs.Bytes - alloc_bytes_before;
+	allocs_before = threadAllocs.Count;
+	alloc_bytes_before = threadAllocs.Bytes;
+	{
+		std::lock_guard<std::mutex> lock(renderStatsLock);
+		lastFrameStats = frameStats;
+	}
+	RenderStats zero = { 0, 0, 0, 0, 0, 0, 0 };
+	frameStats = zero;
+}
+
 struct GLMatrices {
 	glm::mat4 projection;
 	glm::mat4 model;
@@ -31,13 +664,155 @@ struct GLMatrices {
 	GLuint MatrixID;
 } Matrices;
 
+constexpr double PI = 3.14159265358979323846;
+
 float DEG2RAD(float i)
 {
-	return ((i*3.14)/180);
+	return i*PI/180;
+}
+
+/* sin evaluated by the compiler, for the tables below : x is brought back
+   to [-pi,pi], where 14 terms of the Taylor series are exact to a double */
+constexpr double compileTimeSin (double x)
+{
+	while (x > PI)
+		x -= 2*PI;
+	while (x < -PI)
+		x += 2*PI;
+	double term = x, sum = x;
+	for (int n=1; n<14; n++) {
+		term *= -x*x/((2*n)*(2*n + 1));
+		sum += term;
+	}
+	return sum;
+}
+
+constexpr double compileTimeCos (double x)
+{
+	return compileTimeSin(x + PI/2);
+}
+
+/* Points of the unit circle, counterclockwise from (1,0), baked into the binary */
+template <int N>
+struct UnitCircle {
+	GLfloat X[N], Y[N];
+
+	constexpr UnitCircle () : X(), Y()
+	{
+		for (int i=0; i<N; i++) {
+			X[i] = compileTimeCos(2*PI*i/N);
+			Y[i] = compileTimeSin(2*PI*i/N);
+		}
+	}
+};
+
+constexpr UnitCircle<360> unit_circle_360;
+constexpr UnitCircle<120> unit_circle_120;
+constexpr UnitCircle<60> unit_circle_60;
+constexpr UnitCircle<24> unit_circle_24;
+
+/* Circle levels of detail, finest first. Sagitta is the distance between
+   an edge and the arc it cuts, for a unit radius. */
+struct CircleLod {
+	int Vertices;
+	const GLfloat* X;
+	const GLfloat* Y;
+	double Sagitta;
+};
+
+#define CIRCLE_LODS 4
+const CircleLod circle_lods[CIRCLE_LODS] = {
+	{ 360, unit_circle_360.X, unit_circle_360.Y, 1 - compileTimeCos(PI/360) },
+	{ 120, unit_circle_120.X, unit_circle_120.Y, 1 - compileTimeCos(PI/120) },
+	{ 60, unit_circle_60.X, unit_circle_60.Y, 1 - compileTimeCos(PI/60) },
+	{ 24, unit_circle_24.X, unit_circle_24.Y, 1 - compileTimeCos(PI/24) },
+};
+
+/* Coarsest level whose edges stay within tolerance of a circle of this radius */
+const CircleLod& circleLod (float radius, float tolerance)
+{
+	for (int lod=CIRCLE_LODS-1; lod>0; lod--)
+		if (radius*circle_lods[lod].Sagitta <= tolerance)
+			return circle_lods[lod];
+	return circle_lods[0];
+}
+
+/* sin and cos of whole degrees, the angles the canon turns by */
+struct DegreeTable {
+	double Sin[360], Cos[360];
+
+	constexpr DegreeTable () : Sin(), Cos()
+	{
+		for (int i=0; i<360; i++) {
+			Sin[i] = compileTimeSin(PI*i/180);
+			Cos[i] = compileTimeCos(PI*i/180);
+		}
+	}
+};
+
+constexpr DegreeTable degree_table;
+
+/* Table lookup for whole degrees, sin/cos otherwise */
+double sinDeg (double degrees)
+{
+	double whole = floor(degrees);
+	if (degrees != whole || fabs(whole) > 1e9)
+		return sin(degrees*PI/180);
+	int i = (int) fmod(whole, 360);
+	return degree_table.Sin[i < 0 ? i + 360 : i];
+}
+
+double cosDeg (double degrees)
+{
+	double whole = floor(degrees);
+	if (degrees != whole || fabs(whole) > 1e9)
+		return cos(degrees*PI/180);
+	int i = (int) fmod(whole, 360);
+	return degree_table.Cos[i < 0 ? i + 360 : i];
+}
+
+/* The ball leaves from 2 units along the canon, turned by atan(0.5/2) more,
+   that angle being added in degrees : the rotation by it is a constant */
+const double canon_mouth_cos = compileTimeCos(0.24497866312686414*PI/180); // atan(0.25)
+const double canon_mouth_sin = compileTimeSin(0.24497866312686414*PI/180);
+
+/* Start point of a ball shot with the canon at angle degrees */
+void canonMouth (double angle, double* x, double* y)
+{
+	double c = cosDeg(angle), s = sinDeg(angle);
+	*x = -12 + 2*(c*canon_mouth_cos - s*canon_mouth_sin);
+	*y = -6.5 + 2*(s*canon_mouth_cos + c*canon_mouth_sin);
 }
 
 GLuint programID;
 
+/* Circles are rendered either as 360 vertex triangle fans through programID,
+   or as screen aligned quads whose coverage is computed from a signed distance */
+enum { CIRCLE_FAN, CIRCLE_SDF };
+int circle_pipeline = CIRCLE_FAN;
+
+/* Programs the render queue can switch between, indexed by VAO::Program */
+enum { PROGRAM_FLAT, PROGRAM_SDF, PROGRAM_COUNT };
+struct RenderProgram {
+	ResourceHandle Resource;
+	GLuint ID;
+	GLuint MatrixID; // location of the "MVP" uniform
+	bool Blend;      // draw with alpha blending
+} renderPrograms[PROGRAM_COUNT];
+bool headless = false;
+int fb_width, fb_height; // framebuffer size, set by reshapeWindow
+int viewport_width = -1, viewport_height = -1; // framebuffer size the renderer set the viewport for
+
+/* Frame pacing : wait for vblank, adaptive vsync (late frames tear instead
+   of waiting a whole refresh), no wait, or a CPU side limit to target_fps */
+enum { PACING_VSYNC, PACING_ADAPTIVE, PACING_UNCAPPED, PACING_LIMIT, PACING_COUNT };
+const char* pacing_names[PACING_COUNT] = { "vsync", "adaptive", "uncapped", "limit" };
+int pacing_mode = PACING_VSYNC;
+double target_fps = 60;
+
+const char* window_title = "Sample OpenGL 3.3 Application";
+bool show_stats = false; // render stats in the window title, toggled with O
+
 /* Function to load Shaders - Use it as it is */
 GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path) {
 
@@ -120,88 +895,1703 @@ static void error_callback(int error, const char* description)
 	fprintf(stderr, "Error: %s\n", description);
 }
 
+/* Ends the main loop, which then stops the renderer and writes the exit reports */
 void quit(GLFWwindow *window)
 {
-	glfwDestroyWindow(window);
-	glfwTerminate();
-	exit(EXIT_SUCCESS);
+	glfwSetWindowShouldClose(window, GL_TRUE);
 }
 
 
-/* Generate VAO, VBOs and return VAO handle */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
-{
-	struct VAO* vao = new struct VAO;
-	vao->PrimitiveMode = primitive_mode;
-	vao->NumVertices = numVertices;
-	vao->FillMode = fill_mode;
+/* Linear allocator for short lived data (a frame, a mesh being built).
+   alloc() bumps an offset into one block; reset() releases everything
+   at once. When more is needed, a block twice as large is taken and
+   kept, the outgrown one is freed at the next reset : once the largest
+   use was seen, it never touches the heap again. */
+struct LinearArena {
+	char* Block;
+	size_t Size;
+	size_t Used;
+	size_t HighWater;      // most bytes used by a frame
+	vector<char*> Retired; // outgrown blocks, still referenced until the reset
 
-	// Create Vertex Array Object
-	// Should be done after CreateWindow and before any other GL calls
-	glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
-	glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
-	glGenBuffers (1, &(vao->ColorBuffer));  // VBO - colors
+	void* alloc (size_t bytes, size_t align = 16)
+	{
+		size_t offset = (Used + align - 1) & ~(align - 1);
+		if (Block == NULL || offset + bytes > Size) {
+			if (Block != NULL)
+				Retired.push_back(Block);
+			Size = max(Size*2, bytes + align);
+			Block = new char[Size];
+			offset = 0;
+		}
+		Used = offset + bytes;
+		HighWater = max(HighWater, Used);
+		return Block + offset;
+	}
 
-	glBindVertexArray (vao->VertexArrayID); // Bind the VAO 
-	glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices 
-	glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
-	glVertexAttribPointer(
-			0,                  // attribute 0. Vertices
-			3,                  // size (x,y,z)
-			GL_FLOAT,           // type
-			GL_FALSE,           // normalized?
-			0,                  // stride
-			(void*)0            // array buffer offset
-			);
+	template <typename T>
+	T* allocArray (int count)
+	{
+		return (T*) alloc(count*sizeof(T), alignof(T));
+	}
 
-	glBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer); // Bind the VBO colors 
-	glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), color_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
-	glVertexAttribPointer(
-			1,                  // attribute 1. Color
-			3,                  // size (r,g,b)
-			GL_FLOAT,           // type
-			GL_FALSE,           // normalized?
-			0,                  // stride
-			(void*)0            // array buffer offset
-			);
+	void reset ()
+	{
+		for (size_t i=0; i<Retired.size(); i++)
+			delete[] Retired[i];
+		Retired.clear();
+		Used = 0;
+	}
+};
 
-	return vao;
-}
+/* CPU side vertex data of the meshes being built. It is only needed
+   until create3DObject uploads it : the outermost StagingScope resets
+   the arena, so rebuilding meshes reuses the same block. */
+LinearArena stagingArena = { NULL, 16*1024, 0, 0, vector<char*>() };
+int staging_depth = 0;
 
-/* Generate VAO, VBOs and return VAO handle - Common Color for all vertices */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL)
-{
-	GLfloat* color_buffer_data = new GLfloat [3*numVertices];
-	for (int i=0; i<numVertices; i++) {
-		color_buffer_data [3*i] = red;
-		color_buffer_data [3*i + 1] = green;
-		color_buffer_data [3*i + 2] = blue;
+struct StagingScope {
+	StagingScope () { staging_depth++; }
+	~StagingScope ()
+	{
+		if (--staging_depth == 0)
+			stagingArena.reset();
 	}
+};
 
-	return create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
-}
-
-/* Render the VBOs handled by VAO */
-void draw3DObject (struct VAO* vao)
+/* Meshes already uploaded, by content. create3DObject looks the vertex and
+   color data up here first and hands back the existing VAO when the same
+   bytes were uploaded before, so GPU memory and upload time grow with the
+   number of distinct shapes, not with the number of objects using them.
+   A VAO may thus be shared : callers must not change one they did not create. */
+struct MeshKey {
+	unsigned long long Hash; // FNV-1a of the bytes in Data
+	GLenum PrimitiveMode;
+	GLenum FillMode;
+	int NumVertices;
+	int Indexing;
+	const void* Layout; // tag of what createMesh meshes are keyed on, NULL for create3DObject
+	int Program;        // drawing with another program makes another mesh
+	// The source of the mesh, e.g. vertices and colors, compared byte for byte
+	// so that a hash collision cannot hand out the wrong geometry. Registered
+	// keys point to a copy owned by the registry.
+	const void* Data[2];
+	size_t Bytes[2];
+
+	bool operator== (const MeshKey& other) const
+	{
+		if (Hash != other.Hash || PrimitiveMode != other.PrimitiveMode
+				|| FillMode != other.FillMode || NumVertices != other.NumVertices
+				|| Indexing != other.Indexing || Layout != other.Layout || Program != other.Program)
+			return false;
+		for (int i=0; i<2; i++)
+			if (Bytes[i] != other.Bytes[i] || (Bytes[i] > 0 && memcmp(Data[i], other.Data[i], Bytes[i]) != 0))
+				return false;
+		return true;
+	}
+};
+
+struct MeshKeyHash {
+	size_t operator() (const MeshKey& key) const { return (size_t) key.Hash; }
+};
+
+/* Owner of the GPU objects : meshes, programs and buffers. Releasing the
+   last reference to one frees its slot at once, but its GL names are only
+   deleted by collectResources, once a fence shows the GPU finished every
+   frame that could still use them. Handles are made, resolved and
+   released on the thread the GL context is current on. */
+enum ResourceKind { RESOURCE_MESH, RESOURCE_PROGRAM, RESOURCE_BUFFER, RESOURCE_KINDS };
+const char* resource_kind_names[RESOURCE_KINDS] = { "meshes", "programs", "buffers" };
+
+struct ResourceSlot {
+	unsigned int Generation;
+	int Kind;
+	int References;   // 0 when the slot is free
+	size_t Bytes;     // GPU memory held by the object, as uploaded
+	struct VAO* Mesh; // RESOURCE_MESH
+	MeshKey Key;      // RESOURCE_MESH : its entry in meshRegistry
+	GLuint Name;      // RESOURCE_PROGRAM, RESOURCE_BUFFER
+};
+
+/* Released object the GPU may still be using */
+struct ResourceGarbage {
+	int Kind;
+	struct VAO* Mesh;
+	GLuint Name;
+	size_t Bytes;
+};
+
+struct ResourceFence {
+	GLsync Fence;
+	vector<ResourceGarbage> Garbage;
+};
+
+struct ResourceManager {
+	vector<ResourceSlot> Slots;
+	vector<unsigned int> FreeSlots;
+	vector<ResourceGarbage> Released; // not fenced yet
+	vector<ResourceFence> InFlight;   // fenced, oldest first
+	int Live[RESOURCE_KINDS];
+	size_t LiveBytes[RESOURCE_KINDS];
+	size_t PendingBytes;              // released, waiting for the GPU
+	int Deleted;
+} resources;
+
+struct MeshRegistry {
+	unordered_map<MeshKey, MeshHandle, MeshKeyHash> Meshes;
+	int Created;             // create3DObject calls
+	size_t BytesShared;      // uploads avoided by returning an existing mesh
+} meshRegistry;
+
+unsigned long long hashBytes (const void* data, size_t bytes, unsigned long long hash = 14695981039346656037ULL)
+{
+	const unsigned char* p = (const unsigned char*) data;
+	for (size_t i=0; i<bytes; i++) {
+		hash ^= p[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/* Point key at its source bytes, which must stay valid until it is registered, and hash them */
+void setMeshKeyData (MeshKey& key, const void* data, size_t bytes, const void* more = NULL, size_t moreBytes = 0)
+{
+	key.Data[0] = data;
+	key.Bytes[0] = bytes;
+	key.Data[1] = more;
+	key.Bytes[1] = moreBytes;
+	key.Hash = hashBytes(more, moreBytes, hashBytes(data, bytes));
+}
+
+MeshKey makeMeshKey (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode, int indexing, int program)
+{
+	MeshKey key;
+	setMeshKeyData(key, vertex_buffer_data, 3*numVertices*sizeof(GLfloat), color_buffer_data, 3*numVertices*sizeof(GLfloat));
+	key.PrimitiveMode = primitive_mode;
+	key.FillMode = fill_mode;
+	key.NumVertices = numVertices;
+	key.Indexing = indexing;
+	key.Layout = NULL;
+	key.Program = program;
+	return key;
+}
+
+/* Take a free slot for a new object of the given kind, with one reference */
+ResourceHandle newResource (int kind, size_t bytes)
+{
+	ResourceManager& rm = resources;
+	unsigned int index;
+	if (!rm.FreeSlots.empty()) {
+		index = rm.FreeSlots.back();
+		rm.FreeSlots.pop_back();
+	}
+	else {
+		index = rm.Slots.size();
+		ResourceSlot slot = ResourceSlot();
+		slot.Generation = 1;
+		rm.Slots.push_back(slot);
+	}
+
+	ResourceSlot& slot = rm.Slots[index];
+	slot.Kind = kind;
+	slot.References = 1;
+	slot.Bytes = bytes;
+	slot.Mesh = NULL;
+	slot.Name = 0;
+	rm.Live[kind]++;
+	rm.LiveBytes[kind] += bytes;
+
+	ResourceHandle handle = { index, slot.Generation };
+	return handle;
+}
+
+/* Slot of a live handle, NULL if the handle is null or stale */
+ResourceSlot* resolveResource (ResourceHandle handle)
+{
+	if (handle.Index >= resources.Slots.size())
+		return NULL;
+	ResourceSlot& slot = resources.Slots[handle.Index];
+	if (slot.Generation != handle.Generation || slot.References == 0)
+		return NULL;
+	return &slot;
+}
+
+struct VAO* getMesh (MeshHandle handle)
+{
+	ResourceSlot* slot = resolveResource(handle);
+	return (slot != NULL && slot->Kind == RESOURCE_MESH) ? slot->Mesh : NULL;
+}
+
+/* GL name of a program or buffer, 0 if the handle is stale */
+GLuint getResourceName (ResourceHandle handle)
+{
+	ResourceSlot* slot = resolveResource(handle);
+	return (slot != NULL && slot->Kind != RESOURCE_MESH) ? slot->Name : 0;
+}
+
+/* One more owner of the object : it lives until each of them released it */
+ResourceHandle retainResource (ResourceHandle handle)
+{
+	ResourceSlot* slot = resolveResource(handle);
+	if (slot != NULL)
+		slot->References++;
+	return handle;
+}
+
+/* Drop the caller's reference and null its handle. The last one frees
+   the slot now and queues the GL names for collectResources. */
+void releaseResource (ResourceHandle& handle)
+{
+	ResourceManager& rm = resources;
+	ResourceSlot* slot = resolveResource(handle);
+	unsigned int index = handle.Index;
+	handle = NO_RESOURCE;
+	if (slot == NULL || --slot->References > 0)
+		return;
+
+	ResourceGarbage garbage = { slot->Kind, slot->Mesh, slot->Name, slot->Bytes };
+	rm.Live[slot->Kind]--;
+	rm.LiveBytes[slot->Kind] -= slot->Bytes;
+	rm.PendingBytes += slot->Bytes;
+	if (++slot->Generation == 0)
+		slot->Generation = 1;
+	rm.FreeSlots.push_back(index);
+	rm.Released.push_back(garbage);
+
+	if (garbage.Kind == RESOURCE_MESH) {
+		meshRegistry.Meshes.erase(slot->Key);
+		delete[] (const unsigned char*) slot->Key.Data[0]; // the registry's copy, see newMesh
+		releaseResource(garbage.Mesh->SdfQuad);
+	}
+}
+
+/* Delete the GL names of a released object, the GPU is done with them */
+void deleteGarbage (const ResourceGarbage& garbage)
+{
+	switch (garbage.Kind) {
+		case RESOURCE_MESH: {
+			// The name may be handed out again : the state cache must not think it is still bound
+			if (glState.VertexArray == garbage.Mesh->VertexArrayID)
+				stateBindVertexArray(0);
+			glDeleteVertexArrays(1, &garbage.Mesh->VertexArrayID);
+			glDeleteBuffers(1, &garbage.Mesh->VertexBuffer);
+			if (garbage.Mesh->ColorBuffer != 0)
+				glDeleteBuffers(1, &garbage.Mesh->ColorBuffer);
+			delete garbage.Mesh;
+			break;
+		}
+		case RESOURCE_PROGRAM:
+			if (glState.Program == garbage.Name)
+				stateUseProgram(0);
+			glDeleteProgram(garbage.Name);
+			break;
+		case RESOURCE_BUFFER:
+			glDeleteBuffers(1, &garbage.Name);
+			break;
+	}
+	resources.PendingBytes -= garbage.Bytes;
+	resources.Deleted++;
+}
+
+/* Fence the objects released since the last call, and delete those whose
+   fence signalled. Called after each swap; costs nothing when nothing was released. */
+void collectResources ()
+{
+	ResourceManager& rm = resources;
+	if (rm.Released.empty() && rm.InFlight.empty())
+		return;
+
+	AllowAllocScope allow_alloc; // releases come with level changes, not steady state frames
+	if (!rm.Released.empty()) {
+		ResourceFence fence;
+		fence.Fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		fence.Garbage.swap(rm.Released);
+		rm.InFlight.push_back(fence);
+	}
+	while (!rm.InFlight.empty()) {
+		ResourceFence& oldest = rm.InFlight.front();
+		GLenum status = glClientWaitSync(oldest.Fence, 0, 0);
+		if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+			break;
+		for (size_t i=0; i<oldest.Garbage.size(); i++)
+			deleteGarbage(oldest.Garbage[i]);
+		glDeleteSync(oldest.Fence);
+		rm.InFlight.erase(rm.InFlight.begin());
+	}
+}
+
+/* Release every object still alive and delete them all, at exit */
+void destroyResources ()
+{
+	ResourceManager& rm = resources;
+	for (unsigned int i=0; i<rm.Slots.size(); i++)
+		while (rm.Slots[i].References > 0) {
+			ResourceHandle handle = { i, rm.Slots[i].Generation };
+			releaseResource(handle);
+		}
+
+	glFinish();
+	for (size_t f=0; f<rm.InFlight.size(); f++) {
+		for (size_t i=0; i<rm.InFlight[f].Garbage.size(); i++)
+			deleteGarbage(rm.InFlight[f].Garbage[i]);
+		glDeleteSync(rm.InFlight[f].Fence);
+	}
+	rm.InFlight.clear();
+	for (size_t i=0; i<rm.Released.size(); i++)
+		deleteGarbage(rm.Released[i]);
+	rm.Released.clear();
+}
+
+/* Compile and link a program, owned by the resource manager */
+ResourceHandle createProgram (const char* vertex_file_path, const char* fragment_file_path)
+{
+	GLuint name = LoadShaders(vertex_file_path, fragment_file_path);
+	ResourceHandle handle = newResource(RESOURCE_PROGRAM, 0);
+	resources.Slots[handle.Index].Name = name;
+	return handle;
+}
+
+/* Adopt a buffer object of the given size */
+ResourceHandle registerBuffer (GLuint name, size_t bytes)
+{
+	ResourceHandle handle = newResource(RESOURCE_BUFFER, bytes);
+	resources.Slots[handle.Index].Name = name;
+	return handle;
+}
+
+/* Meshes drawn as GL_TRIANGLES can take their indices from a buffer shared
+   by all of them instead of repeating vertices :
+   INDEX_QUADS  : 4 vertices per quad, 0 1 2, 2 3 0 (the order of the 6
+                  vertex quads, without the 2 copies)
+   INDEX_FAN    : one convex polygon, 0 i i+1 like a triangle fan
+   Indices are 16 bits, so a mesh has at most MAX_INDEXED_VERTICES vertices. */
+enum MeshIndexing { INDEX_NONE, INDEX_QUADS, INDEX_FAN, INDEX_KINDS };
+#define MAX_INDEXED_VERTICES 4096
+
+struct SharedIndices {
+	ResourceHandle Buffers[INDEX_KINDS]; // INDEX_NONE unused
+	GLuint Names[INDEX_KINDS];
+} sharedIndices;
+
+/* Whether a mesh of numVertices vertices can take its indices from the shared buffer */
+bool indexingFits (int indexing, int numVertices)
+{
+	switch (indexing) {
+		case INDEX_QUADS: return numVertices % 4 == 0 && numVertices <= MAX_INDEXED_VERTICES;
+		case INDEX_FAN: return numVertices >= 3 && numVertices <= MAX_INDEXED_VERTICES;
+		default: return true;
+	}
+}
+
+/* Indices of a mesh of numVertices vertices with the given indexing */
+int indexCount (int indexing, int numVertices)
+{
+	switch (indexing) {
+		case INDEX_QUADS: return 6*(numVertices/4);
+		case INDEX_FAN: return 3*max(numVertices - 2, 0);
+		default: return 0;
+	}
+}
+
+/* Element buffer of the given indexing, made on first use */
+GLuint sharedIndexBuffer (int indexing)
+{
+	SharedIndices& si = sharedIndices;
+	if (getResourceName(si.Buffers[indexing]) != 0)
+		return si.Names[indexing];
+
+	StagingScope staging;
+	int count = indexCount(indexing, MAX_INDEXED_VERTICES);
+	GLushort* indices = stagingArena.allocArray<GLushort>(count);
+	if (indexing == INDEX_QUADS) {
+		for (int q=0; q<MAX_INDEXED_VERTICES/4; q++) {
+			GLushort v = 4*q;
+			GLushort quad[6] = { v, (GLushort)(v+1), (GLushort)(v+2), (GLushort)(v+2), (GLushort)(v+3), v };
+			for (int i=0; i<6; i++)
+				indices[6*q + i] = quad[i];
+		}
+	}
+	else {
+		for (int t=0; t<MAX_INDEXED_VERTICES-2; t++) {
+			indices[3*t] = 0;
+			indices[3*t + 1] = t+1;
+			indices[3*t + 2] = t+2;
+		}
+	}
+
+	// The element buffer binding is VAO state, and a core profile has no
+	// default VAO to upload through : fill it from a target no VAO records
+	glGenBuffers(1, &si.Names[indexing]);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, si.Names[indexing]);
+	glBufferData(GL_COPY_WRITE_BUFFER, count*sizeof(GLushort), indices, GL_STATIC_DRAW);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	frameStats.BytesUploaded += count*sizeof(GLushort);
+	si.Buffers[indexing] = registerBuffer(si.Names[indexing], count*sizeof(GLushort));
+	return si.Names[indexing];
+}
+
+/* A new reference to a mesh registered under key, NO_RESOURCE if there is none */
+MeshHandle findMesh (const MeshKey& key, size_t bytes)
+{
+	meshRegistry.Created++;
+	unordered_map<MeshKey, MeshHandle, MeshKeyHash>::iterator found = meshRegistry.Meshes.find(key);
+	if (found == meshRegistry.Meshes.end())
+		return NO_RESOURCE;
+	meshRegistry.BytesShared += bytes;
+	return retainResource(found->second);
+}
+
+/* VAO of a new mesh of the given size, registered under key. Its bounds are
+   taken from the x,y floats found every positionStride floats from positions,
+   or left for the caller to set if positions is NULL. */
+struct VAO* newMesh (MeshHandle& handle, const MeshKey& key, size_t bytes, const GLfloat* positions, int positionStride)
+{
+	if (!indexingFits(key.Indexing, key.NumVertices)) {
+		// Drawing it would read indices past the shared buffer
+		fprintf(stderr, "Mesh of %d vertices cannot use shared indices of kind %d\n", key.NumVertices, key.Indexing);
+		abort();
+	}
+
+	// The caller's source bytes are gone after the call : keep a copy to compare keys with
+	unsigned char* data = new unsigned char[key.Bytes[0] + key.Bytes[1]];
+	MeshKey registered = key;
+	registered.Data[0] = data;
+	registered.Data[1] = data + key.Bytes[0];
+	for (int i=0; i<2; i++)
+		if (key.Bytes[i] > 0)
+			memcpy((void*) registered.Data[i], key.Data[i], key.Bytes[i]);
+
+	handle = newResource(RESOURCE_MESH, bytes);
+	struct VAO* vao = new struct VAO;
+	resources.Slots[handle.Index].Mesh = vao;
+	resources.Slots[handle.Index].Key = registered;
+	meshRegistry.Meshes[registered] = handle;
+	vao->PrimitiveMode = key.PrimitiveMode;
+	vao->NumVertices = key.NumVertices;
+	vao->NumIndices = indexCount(key.Indexing, key.NumVertices);
+	vao->FillMode = key.FillMode;
+	vao->Program = key.Program;
+	vao->SdfQuad = NO_RESOURCE;
+	vao->EnabledAttribs = 0;
+
+	vao->MinX = vao->MinY = 1e30f;
+	vao->MaxX = vao->MaxY = -1e30f;
+	for (int i=0; positions != NULL && i<key.NumVertices; i++) {
+		const GLfloat* p = positions + i*positionStride;
+		vao->MinX = min(vao->MinX, p[0]);
+		vao->MaxX = max(vao->MaxX, p[0]);
+		vao->MinY = min(vao->MinY, p[1]);
+		vao->MaxY = max(vao->MaxY, p[1]);
+	}
+
+	glGenVertexArrays(1, &(vao->VertexArrayID));
+	return vao;
+}
+
+/* Record the shared index buffer of the given indexing in vao, if any */
+void bindSharedIndices (struct VAO* vao, int indexing)
+{
+	if (indexing == INDEX_NONE)
+		return;
+	GLuint indices = sharedIndexBuffer(indexing);
+	stateBindVertexArray (vao->VertexArrayID);
+	glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, indices); // recorded in the VAO
+}
+
+/* Generate VAO, VBOs and return the mesh handle, or a new reference to an identical mesh.
+   Indexed meshes (indexing not INDEX_NONE) are GL_TRIANGLES, see MeshIndexing. */
+MeshHandle create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL, int indexing=INDEX_NONE, int program=PROGRAM_FLAT)
+{
+	MeshKey key = makeMeshKey(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode, indexing, program);
+	MeshHandle handle = findMesh(key, 2*3*numVertices*sizeof(GLfloat));
+	if (getMesh(handle) != NULL)
+		return handle;
+	struct VAO* vao = newMesh(handle, key, 2*3*numVertices*sizeof(GLfloat), vertex_buffer_data, 3);
+
+	// Create Vertex Array Object
+	// Should be done after CreateWindow and before any other GL calls
+	glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
+	glGenBuffers (1, &(vao->ColorBuffer));  // VBO - colors
+
+	stateBindVertexArray (vao->VertexArrayID); // Bind the VAO 
+	glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices 
+	glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
+	glVertexAttribPointer(
+			0,                  // attribute 0. Vertices
+			3,                  // size (x,y,z)
+			GL_FLOAT,           // type
+			GL_FALSE,           // normalized?
+			0,                  // stride
+			(void*)0            // array buffer offset
+			);
+
+	glBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer); // Bind the VBO colors 
+	glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), color_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
+	frameStats.BytesUploaded += 2*3*numVertices*sizeof(GLfloat);
+	glVertexAttribPointer(
+			1,                  // attribute 1. Color
+			3,                  // size (r,g,b)
+			GL_FLOAT,           // type
+			GL_FALSE,           // normalized?
+			0,                  // stride
+			(void*)0            // array buffer offset
+			);
+
+	bindSharedIndices(vao, indexing);
+	return handle;
+}
+
+/* Generate VAO, VBOs and return the mesh handle - Common Color for all vertices */
+MeshHandle create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL, int indexing=INDEX_NONE, int program=PROGRAM_FLAT)
+{
+	StagingScope staging;
+	GLfloat* color_buffer_data = stagingArena.allocArray<GLfloat>(3*numVertices);
+	for (int i=0; i<numVertices; i++) {
+		color_buffer_data [3*i] = red;
+		color_buffer_data [3*i + 1] = green;
+		color_buffer_data [3*i + 2] = blue;
+	}
+
+	return create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode, indexing, program);
+}
+
+/* Vertex layouts described at compile time, for createMesh. An attribute
+   is a component type, a component count and, for integer types, whether
+   the values are normalized to [0,1] or [-1,1]. A layout binds a vertex
+   struct to its attributes, interleaved in that order at locations 0, 1...
+   Stride and offsets are constants : the attribute setup unrolls into
+   plain glVertexAttribPointer calls, and a vertex struct that does not
+   match its layout fails to compile. */
+template <typename T> struct GLTypeOf;
+template <> struct GLTypeOf<GLfloat> { static const GLenum Value = GL_FLOAT; };
+template <> struct GLTypeOf<GLbyte> { static const GLenum Value = GL_BYTE; };
+template <> struct GLTypeOf<GLubyte> { static const GLenum Value = GL_UNSIGNED_BYTE; };
+template <> struct GLTypeOf<GLshort> { static const GLenum Value = GL_SHORT; };
+template <> struct GLTypeOf<GLushort> { static const GLenum Value = GL_UNSIGNED_SHORT; };
+
+template <typename T, int N, bool Normalized = false>
+struct Attrib {
+	static const GLenum Type = GLTypeOf<T>::Value;
+	static const int Components = N;
+	static const GLboolean Normalize = Normalized ? GL_TRUE : GL_FALSE;
+	static constexpr size_t Size = N*sizeof(T);
+	static constexpr bool IsFloat = Type == GL_FLOAT;
+};
+
+template <typename... Attribs> struct AttribList;
+
+template <> struct AttribList<> {
+	static constexpr size_t Size = 0;
+	static void setup (GLuint, GLsizei, size_t) {}
+	static void enable (struct VAO*, GLuint) {}
+};
+
+template <typename A, typename... Rest> struct AttribList<A, Rest...> {
+	static constexpr size_t Size = A::Size + AttribList<Rest...>::Size;
+
+	// Pointer of A at location index and byte offset, then of the following attributes
+	static void setup (GLuint index, GLsizei stride, size_t offset)
+	{
+		glVertexAttribPointer(index, A::Components, A::Type, A::Normalize, stride, (void*) offset);
+		AttribList<Rest...>::setup(index + 1, stride, offset + A::Size);
+	}
+
+	static void enable (struct VAO* vao, GLuint index)
+	{
+		stateEnableAttrib(vao, index);
+		AttribList<Rest...>::enable(vao, index + 1);
+	}
+};
+
+template <typename V, typename Position, typename... Others>
+struct VertexLayout {
+	typedef V Vertex;
+	typedef AttribList<Position, Others...> Attribs;
+	static constexpr GLsizei Stride = Attribs::Size;
+
+	static_assert(sizeof(V) == Attribs::Size, "vertex struct does not match its layout");
+	static_assert(Position::IsFloat && Position::Components >= 2, "location 0 must be a float x,y position");
+	static_assert(sizeof(V) % sizeof(GLfloat) == 0, "vertices must keep their position float aligned");
+};
+
+/* 2D position and 8 bit color, 12 bytes a vertex instead of 24 */
+struct PackedVertex {
+	GLfloat X, Y;
+	GLubyte R, G, B, A;
+};
+typedef VertexLayout<PackedVertex, Attrib<GLfloat,2>, Attrib<GLubyte,4,true> > PackedLayout;
+
+/* create3DObject for key.NumVertices vertices interleaved in one VBO, described
+   by Layout. write(source, out) writes them in order straight into the mapped
+   VBO, or into staging memory when it cannot be mapped : it must not read out
+   back. bounds(source, vao) sets the model space bounds of a new mesh, as
+   its vertices are never read. */
+template <typename Layout, typename Source>
+MeshHandle createMesh (const MeshKey& key, void (*write) (const Source& source, typename Layout::Vertex* out),
+		void (*bounds) (const Source& source, struct VAO* vao), const Source& source)
+{
+	size_t bytes = key.NumVertices*Layout::Stride;
+	MeshHandle handle = findMesh(key, bytes);
+	if (getMesh(handle) != NULL)
+		return handle;
+	struct VAO* vao = newMesh(handle, key, bytes, NULL, 0);
+	bounds(source, vao);
+
+	glGenBuffers (1, &(vao->VertexBuffer));
+	vao->ColorBuffer = 0; // interleaved in VertexBuffer
+
+	stateBindVertexArray (vao->VertexArrayID);
+	glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer);
+	glBufferData (GL_ARRAY_BUFFER, bytes, NULL, GL_STATIC_DRAW);
+	typename Layout::Vertex* mapped = (typename Layout::Vertex*) glMapBufferRange (GL_ARRAY_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	bool uploaded = false;
+	if (mapped != NULL) {
+		write(source, mapped);
+		uploaded = glUnmapBuffer (GL_ARRAY_BUFFER) == GL_TRUE; // false if the storage was lost meanwhile
+	}
+	if (!uploaded) {
+		StagingScope staging;
+		typename Layout::Vertex* vertices = stagingArena.allocArray<typename Layout::Vertex>(key.NumVertices);
+		write(source, vertices);
+		glBufferSubData (GL_ARRAY_BUFFER, 0, bytes, vertices);
+	}
+	frameStats.BytesUploaded += bytes;
+	Layout::Attribs::setup(0, Layout::Stride, 0);
+	Layout::Attribs::enable(vao, 0);
+
+	bindSharedIndices(vao, key.Indexing);
+	return handle;
+}
+
+/* Largest distance in world units a curved edge may be from the true
+   curve : 1/50 pixel in the default view, still under a pixel zoomed in 50 times */
+#define CIRCLE_TOLERANCE 0.0005f
+
+/* Procedural shapes, centered on the origin and placed by the model matrix.
+   Tessellation only writes the vertices, in order, so createShape can have
+   it fill a mapped VBO directly. Points on arcs are computed 4 at a time
+   (SSE2 when available) as a rotation and scale of unit vectors : baked
+   unit circles for full circles and rings, a rotation recurrence otherwise.
+   Edges stay within CIRCLE_TOLERANCE of the true curves. */
+enum ShapeType { SHAPE_CIRCLE, SHAPE_ARC, SHAPE_RING, SHAPE_ROUNDED_RECT, SHAPE_CAPSULE, SHAPE_POLYGON, SHAPE_TYPES };
+
+struct Shape {
+	int Type;
+	GLubyte Color[4];
+	float Radius;         // circle, outer radius of arcs and rings, corner radius, capsule radius
+	float Inner;          // inner radius of arcs and rings
+	float Start, End;     // arc angles in radians, counterclockwise
+	float Width, Height;  // rounded rectangle size; capsule : distance between the cap centers
+	int NumPoints;        // polygon
+	const GLfloat* Points; // polygon : x,y pairs of a convex outline, counterclockwise
+};
+
+Shape makeShape (int type, GLfloat red, GLfloat green, GLfloat blue)
+{
+	Shape shape = Shape();
+	shape.Type = type;
+	shape.Color[0] = (GLubyte) lround(red*255);
+	shape.Color[1] = (GLubyte) lround(green*255);
+	shape.Color[2] = (GLubyte) lround(blue*255);
+	shape.Color[3] = 255;
+	return shape;
+}
+
+Shape circleShape (float radius, GLfloat red, GLfloat green, GLfloat blue)
+{
+	Shape shape = makeShape(SHAPE_CIRCLE, red, green, blue);
+	shape.Radius = radius;
+	return shape;
+}
+
+/* Band between inner and radius, from angle start to end */
+Shape arcShape (float inner, float radius, float start, float end, GLfloat red, GLfloat green, GLfloat blue)
+{
+	Shape shape = makeShape(SHAPE_ARC, red, green, blue);
+	shape.Inner = inner;
+	shape.Radius = radius;
+	shape.Start = start;
+	shape.End = end;
+	return shape;
+}
+
+Shape ringShape (float inner, float radius, GLfloat red, GLfloat green, GLfloat blue)
+{
+	Shape shape = makeShape(SHAPE_RING, red, green, blue);
+	shape.Inner = inner;
+	shape.Radius = radius;
+	return shape;
+}
+
+Shape roundedRectShape (float width, float height, float corner, GLfloat red, GLfloat green, GLfloat blue)
+{
+	Shape shape = makeShape(SHAPE_ROUNDED_RECT, red, green, blue);
+	shape.Width = width;
+	shape.Height = height;
+	shape.Radius = min(corner, 0.5f*min(width, height));
+	return shape;
+}
+
+/* Horizontal capsule : two half circles length apart, joined by their tangents */
+Shape capsuleShape (float length, float radius, GLfloat red, GLfloat green, GLfloat blue)
+{
+	Shape shape = makeShape(SHAPE_CAPSULE, red, green, blue);
+	shape.Width = length;
+	shape.Radius = radius;
+	return shape;
+}
+
+/* points must outlive the shape until createShape or tessellateShape used it */
+Shape polygonShape (int numPoints, const GLfloat* points, GLfloat red, GLfloat green, GLfloat blue)
+{
+	Shape shape = makeShape(SHAPE_POLYGON, red, green, blue);
+	shape.NumPoints = numPoints;
+	shape.Points = points;
+	return shape;
+}
+
+/* Segments of an arc of the given radius and angle span within CIRCLE_TOLERANCE.
+   The sagitta of a segment of angle a is about radius*a*a/8. A negative
+   span is a clockwise arc, as long as the counterclockwise one. */
+int arcSegments (float radius, float span)
+{
+	float step = sqrtf(8*CIRCLE_TOLERANCE/max(radius, CIRCLE_TOLERANCE));
+	return max(1, min(4096, (int) ceilf(fabsf(span)/step)));
+}
+
+int shapeVertexCount (const Shape& shape)
+{
+	switch (shape.Type) {
+		case SHAPE_CIRCLE: return circleLod(shape.Radius, CIRCLE_TOLERANCE).Vertices;
+		case SHAPE_ARC: return 2*(arcSegments(shape.Radius, shape.End - shape.Start) + 1);
+		case SHAPE_RING: return 2*(circleLod(shape.Radius, CIRCLE_TOLERANCE).Vertices + 1);
+		case SHAPE_ROUNDED_RECT: return 4*(arcSegments(shape.Radius, PI/2) + 1);
+		case SHAPE_CAPSULE: return 2*(arcSegments(shape.Radius, PI) + 1);
+		case SHAPE_POLYGON: return shape.NumPoints;
+		default: return 0;
+	}
+}
+
+/* Fans for the filled convex shapes, strips for the bands */
+GLenum shapePrimitive (const Shape& shape)
+{
+	return (shape.Type == SHAPE_ARC || shape.Type == SHAPE_RING) ? GL_TRIANGLE_STRIP : GL_TRIANGLE_FAN;
+}
+
+/* out[k*stride] = (cx,cy) + r*M*(ux[k],uy[k]) in the given color, for k in [0,n).
+   M is row major. out is only written to, never read. */
+void emitPoints (PackedVertex* out, int stride, const GLfloat* ux, const GLfloat* uy, int n,
+		float cx, float cy, float r, const float m[4], const GLubyte color[4])
+{
+	int k = 0;
+#ifdef __SSE2__
+	__m128 m00 = _mm_set1_ps(r*m[0]), m01 = _mm_set1_ps(r*m[1]);
+	__m128 m10 = _mm_set1_ps(r*m[2]), m11 = _mm_set1_ps(r*m[3]);
+	__m128 center_x = _mm_set1_ps(cx), center_y = _mm_set1_ps(cy);
+	for (; k+4 <= n; k += 4) {
+		__m128 x = _mm_loadu_ps(ux + k);
+		__m128 y = _mm_loadu_ps(uy + k);
+		__m128 px = _mm_add_ps(center_x, _mm_add_ps(_mm_mul_ps(m00, x), _mm_mul_ps(m01, y)));
+		__m128 py = _mm_add_ps(center_y, _mm_add_ps(_mm_mul_ps(m10, x), _mm_mul_ps(m11, y)));
+		__m128 xy01 = _mm_unpacklo_ps(px, py);
+		__m128 xy23 = _mm_unpackhi_ps(px, py);
+		PackedVertex* v = out + k*stride;
+		_mm_storel_pi((__m64*) &v[0].X, xy01);
+		_mm_storeh_pi((__m64*) &v[stride].X, xy01);
+		_mm_storel_pi((__m64*) &v[2*stride].X, xy23);
+		_mm_storeh_pi((__m64*) &v[3*stride].X, xy23);
+		for (int i=0; i<4; i++)
+			memcpy(&v[i*stride].R, color, 4);
+	}
+#endif
+	for (; k<n; k++) {
+		PackedVertex* v = out + k*stride;
+		v->X = cx + r*(m[0]*ux[k] + m[1]*uy[k]);
+		v->Y = cy + r*(m[2]*ux[k] + m[3]*uy[k]);
+		memcpy(&v->R, color, 4);
+	}
+}
+
+/* Unit vectors at angles k*step for k in [0,n). ux and uy have room for n
+   rounded up to 4. Four lanes turn by 4*step each round, restarting from
+   sin/cos every 64 points so that rounding does not build up. */
+void unitArc (int n, float step, GLfloat* ux, GLfloat* uy)
+{
+	const int restart = 64;
+	float turn_c = cosf(4*step), turn_s = sinf(4*step);
+	for (int base=0; base<n; base+=restart) {
+		int end = min(n, base + restart);
+		float c[4], s[4];
+		for (int i=0; i<4; i++) {
+			c[i] = cosf((base + i)*step);
+			s[i] = sinf((base + i)*step);
+		}
+#ifdef __SSE2__
+		__m128 vc = _mm_loadu_ps(c), vs = _mm_loadu_ps(s);
+		__m128 tc = _mm_set1_ps(turn_c), ts = _mm_set1_ps(turn_s);
+		for (int k=base; k<end; k+=4) {
+			_mm_storeu_ps(ux + k, vc);
+			_mm_storeu_ps(uy + k, vs);
+			__m128 next_c = _mm_sub_ps(_mm_mul_ps(vc, tc), _mm_mul_ps(vs, ts));
+			vs = _mm_add_ps(_mm_mul_ps(vs, tc), _mm_mul_ps(vc, ts));
+			vc = next_c;
+		}
+#else
+		for (int k=base; k<end; k+=4)
+			for (int i=0; i<4; i++) {
+				ux[k + i] = c[i];
+				uy[k + i] = s[i];
+				float next_c = c[i]*turn_c - s[i]*turn_s;
+				s[i] = s[i]*turn_c + c[i]*turn_s;
+				c[i] = next_c;
+			}
+#endif
+	}
+}
+
+/* Row major rotations by 0, 90, 180 and 270 degrees */
+const float quarter_turns[4][4] = {
+	{ 1, 0, 0, 1 },
+	{ 0, -1, 1, 0 },
+	{ -1, 0, 0, -1 },
+	{ 0, 1, -1, 0 },
+};
+
+/* Write the shapeVertexCount(shape) vertices of shape to out, in order */
+void tessellateShape (const Shape& shape, PackedVertex* out)
+{
+	StagingScope staging;
+	const float* identity = quarter_turns[0];
+	switch (shape.Type) {
+		case SHAPE_CIRCLE: {
+			const CircleLod& lod = circleLod(shape.Radius, CIRCLE_TOLERANCE);
+			emitPoints(out, 1, lod.X, lod.Y, lod.Vertices, 0, 0, shape.Radius, identity, shape.Color);
+			break;
+		}
+		case SHAPE_RING: {
+			// Inner and outer points alternate, the first pair is repeated to close the strip
+			const CircleLod& lod = circleLod(shape.Radius, CIRCLE_TOLERANCE);
+			emitPoints(out, 2, lod.X, lod.Y, lod.Vertices, 0, 0, shape.Inner, identity, shape.Color);
+			emitPoints(out + 1, 2, lod.X, lod.Y, lod.Vertices, 0, 0, shape.Radius, identity, shape.Color);
+			emitPoints(out + 2*lod.Vertices, 2, lod.X, lod.Y, 1, 0, 0, shape.Inner, identity, shape.Color);
+			emitPoints(out + 2*lod.Vertices + 1, 2, lod.X, lod.Y, 1, 0, 0, shape.Radius, identity, shape.Color);
+			break;
+		}
+		case SHAPE_ARC: {
+			float span = shape.End - shape.Start;
+			int n = arcSegments(shape.Radius, span) + 1;
+			GLfloat* ux = stagingArena.allocArray<GLfloat>((n + 3) & ~3);
+			GLfloat* uy = stagingArena.allocArray<GLfloat>((n + 3) & ~3);
+			unitArc(n, span/(n - 1), ux, uy);
+			float c = cosf(shape.Start), s = sinf(shape.Start);
+			float start[4] = { c, -s, s, c };
+			emitPoints(out, 2, ux, uy, n, 0, 0, shape.Inner, start, shape.Color);
+			emitPoints(out + 1, 2, ux, uy, n, 0, 0, shape.Radius, start, shape.Color);
+			break;
+		}
+		case SHAPE_ROUNDED_RECT: {
+			// A quarter circle per corner, counterclockwise from the top right one
+			int n = arcSegments(shape.Radius, PI/2) + 1;
+			GLfloat* ux = stagingArena.allocArray<GLfloat>((n + 3) & ~3);
+			GLfloat* uy = stagingArena.allocArray<GLfloat>((n + 3) & ~3);
+			unitArc(n, (PI/2)/(n - 1), ux, uy);
+			float hx = 0.5f*shape.Width - shape.Radius, hy = 0.5f*shape.Height - shape.Radius;
+			const float corner_x[4] = { hx, -hx, -hx, hx };
+			const float corner_y[4] = { hy, hy, -hy, -hy };
+			for (int q=0; q<4; q++)
+				emitPoints(out + q*n, 1, ux, uy, n, corner_x[q], corner_y[q], shape.Radius, quarter_turns[q], shape.Color);
+			break;
+		}
+		case SHAPE_CAPSULE: {
+			// Right cap from -90 to 90 degrees, then left cap from 90 to 270
+			int n = arcSegments(shape.Radius, PI) + 1;
+			GLfloat* ux = stagingArena.allocArray<GLfloat>((n + 3) & ~3);
+			GLfloat* uy = stagingArena.allocArray<GLfloat>((n + 3) & ~3);
+			unitArc(n, PI/(n - 1), ux, uy);
+			emitPoints(out, 1, ux, uy, n, 0.5f*shape.Width, 0, shape.Radius, quarter_turns[3], shape.Color);
+			emitPoints(out + n, 1, ux, uy, n, -0.5f*shape.Width, 0, shape.Radius, quarter_turns[1], shape.Color);
+			break;
+		}
+		case SHAPE_POLYGON:
+			for (int i=0; i<shape.NumPoints; i++) {
+				out[i].X = shape.Points[2*i];
+				out[i].Y = shape.Points[2*i + 1];
+				memcpy(&out[i].R, shape.Color, 4);
+			}
+			break;
+	}
+}
+
+/* Model space bounds of the shape, without looking at its vertices */
+void shapeBounds (const Shape& shape, struct VAO* vao)
+{
+	float hx = shape.Radius, hy = shape.Radius;
+	if (shape.Type == SHAPE_ROUNDED_RECT) {
+		hx = 0.5f*shape.Width;
+		hy = 0.5f*shape.Height;
+	}
+	else if (shape.Type == SHAPE_CAPSULE)
+		hx = 0.5f*shape.Width + shape.Radius;
+	vao->MinX = -hx;
+	vao->MaxX = hx;
+	vao->MinY = -hy;
+	vao->MaxY = hy;
+
+	if (shape.Type == SHAPE_POLYGON) {
+		vao->MinX = vao->MinY = 1e30f;
+		vao->MaxX = vao->MaxY = -1e30f;
+		for (int i=0; i<shape.NumPoints; i++) {
+			vao->MinX = min(vao->MinX, shape.Points[2*i]);
+			vao->MaxX = max(vao->MaxX, shape.Points[2*i]);
+			vao->MinY = min(vao->MinY, shape.Points[2*i + 1]);
+			vao->MaxY = max(vao->MaxY, shape.Points[2*i + 1]);
+		}
+	}
+}
+
+/* Shapes are registered by their parameters : the same ones always tessellate the same */
+const char shape_layout_tag = 0;
+
+/* The named fields of a Shape, its mesh key. Shape itself has padding
+   before Points, which copies of a Shape do not have to preserve. */
+struct ShapeParams {
+	int Type;
+	GLubyte Color[4];
+	float Radius, Inner, Start, End, Width, Height;
+	int NumPoints;
+};
+static_assert(sizeof(ShapeParams) == 2*sizeof(int) + 4 + 6*sizeof(float), "ShapeParams must not be padded");
+
+/* Mesh of a shape, tessellated straight into its mapped VBO */
+MeshHandle createShape (const Shape& shape)
+{
+	ShapeParams params;
+	params.Type = shape.Type;
+	memcpy(params.Color, shape.Color, sizeof(params.Color));
+	params.Radius = shape.Radius;
+	params.Inner = shape.Inner;
+	params.Start = shape.Start;
+	params.End = shape.End;
+	params.Width = shape.Width;
+	params.Height = shape.Height;
+	params.NumPoints = shape.NumPoints;
+
+	MeshKey key;
+	// Points are keyed by their values
+	setMeshKeyData(key, &params, sizeof(params), shape.Points, 2*shape.NumPoints*sizeof(GLfloat));
+	key.PrimitiveMode = shapePrimitive(shape);
+	key.FillMode = GL_FILL;
+	key.NumVertices = shapeVertexCount(shape);
+	key.Indexing = INDEX_NONE;
+	key.Layout = &shape_layout_tag;
+	key.Program = PROGRAM_FLAT;
+	return createMesh<PackedLayout>(key, tessellateShape, shapeBounds, shape);
+}
+
+/* Render count vertices of the VBOs handled by VAO, starting from vertex first.
+   For an indexed VAO, first and count are positions in its index buffer. */
+void draw3DObject (struct VAO* vao, GLenum primitive_mode, int first, int count)
 {
 	// Change the Fill Mode for this object
-	glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
+	statePolygonMode (vao->FillMode);
 
 	// Bind the VAO to use
-	glBindVertexArray (vao->VertexArrayID);
+	stateBindVertexArray (vao->VertexArrayID);
 
 	// Enable Vertex Attribute 0 - 3d Vertices
-	glEnableVertexAttribArray(0);
-	// Bind the VBO to use
-	glBindBuffer(GL_ARRAY_BUFFER, vao->VertexBuffer);
+	stateEnableAttrib (vao, 0);
 
 	// Enable Vertex Attribute 1 - Color
-	glEnableVertexAttribArray(1);
-	// Bind the VBO to use
-	glBindBuffer(GL_ARRAY_BUFFER, vao->ColorBuffer);
+	stateEnableAttrib (vao, 1);
+
+	// The VBOs are recorded in the VAO by glVertexAttribPointer, no need to bind them here
 
 	// Draw the geometry !
-	glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+	if (vao->NumIndices > 0)
+		glDrawElements(primitive_mode, count, GL_UNSIGNED_SHORT, (void*)(first*sizeof(GLushort)));
+	else
+		glDrawArrays(primitive_mode, first, count);
+	frameStats.DrawCalls++;
+	frameStats.Vertices += count;
+}
+
+/* Vertices, or indices if indexed, drawn for the whole VAO */
+int drawCount (struct VAO* vao)
+{
+	return vao->NumIndices > 0 ? vao->NumIndices : vao->NumVertices;
+}
+
+/* Render the VBOs handled by VAO */
+void draw3DObject (struct VAO* vao)
+{
+	draw3DObject(vao, vao->PrimitiveMode, 0, drawCount(vao)); // Starting from vertex 0; 3 vertices total -> 1 triangle
+}
+
+/* Quad covering a circle of given radius, for the SDF circle pipeline */
+MeshHandle createSdfQuad (float radius, GLfloat red, GLfloat green, GLfloat blue)
+{
+	// Must match SDF_PAD in Sample_GL_sdf.vert
+	const float pad = 1.0625f * radius;
+
+	// Triangle strip order : the vertex shader derives circle space from gl_VertexID
+	GLfloat vertex_buffer_data [] = {
+		-pad,-pad,0,
+		pad,-pad,0,
+		-pad,pad,0,
+		pad,pad,0
+	};
+
+	return create3DObject(GL_TRIANGLE_STRIP, 4, vertex_buffer_data, red, green, blue, GL_FILL, INDEX_NONE, PROGRAM_SDF);
+}
+
+/* Give circle its SDF quad, which it then owns. A shared circle keeps the quad it already has. */
+void setSdfQuad (MeshHandle circle, MeshHandle quad)
+{
+	struct VAO* vao = getMesh(circle);
+	if (vao == NULL || getMesh(vao->SdfQuad) != NULL)
+		releaseResource(quad);
+	else
+		vao->SdfQuad = quad;
+}
+
+/* Scratch of the frame being rendered, reset by render(). Only the thread drawing uses it. */
+LinearArena frameArena = { NULL, 64*1024, 0, 0, vector<char*>() };
+
+/* Draw order layers, a layer is entirely drawn before the next one */
+enum RenderLayer {
+	LAYER_SKY,        // under the speed bar
+	LAYER_BACKGROUND, // speed bar, ground
+	LAYER_PROPS,      // static scenery and obstacles
+	LAYER_TARGETS,
+	LAYER_BALLS,
+	LAYER_CANON,
+	LAYER_HUD,        // speed arrow
+	LAYER_COUNT
+};
+
+/* 64 bit sort key, most significant first :
+   layer (8 bits) | depth (16 bits) | program (8 bits) | VAO (16 bits) | sequence (16 bits)
+   Sorting on it draws layers in order, and draws given a depth front to
+   back. Draws of a layer at the same depth are grouped by program and VAO,
+   so the state cache elides their binds. Draws in a layer must not
+   overlap unless they get different layers or depths ; the sequence of
+   submissions only breaks the ties left, so equal keys never leave the
+   order to chance. */
+typedef unsigned long long RenderKey;
+
+RenderKey makeRenderKey (int layer, float depth, int program, GLuint vertexArray, unsigned int sequence)
+{
+	// depth in [0,1), front to back
+	RenderKey d = (RenderKey) (glm::clamp(depth, 0.0f, 1.0f) * 0xFFFF) & 0xFFFF;
+	return ((RenderKey) (layer & 0xFF) << 56) | (d << 40) | ((RenderKey) (program & 0xFF) << 32)
+		| ((RenderKey) (vertexArray & 0xFFFF) << 16) | (sequence & 0xFFFF);
+}
+
+struct RenderItem {
+	RenderKey Key;
+	struct VAO* Vao;
+	GLenum PrimitiveMode;
+	int First;  // range of vertices to draw
+	int Count;
+	glm::mat4 MVP;
+};
+
+/* Per frame list of draws, filled by submitDraw and drawn by executeRenderQueue.
+   Items and Order live in frameArena, they are gone after the frame. */
+struct RenderQueue {
+	glm::mat4 VP;
+	float Left, Right, Bottom, Top; // visible area in world space, draws outside it are culled
+	int Submitted;  // draws submitted this frame, including culled ones
+	int Culled;
+	unsigned int Sequence[LAYER_COUNT]; // next submission number of each layer
+	RenderItem* Items;
+	int Count;
+	int Capacity;
+	int* Order;     // indices in Items, sorted by key
+} renderQueue;
+
+void pushRenderItem (const RenderItem& item)
+{
+	RenderQueue& rq = renderQueue;
+	if (rq.Count == rq.Capacity) {
+		// Arena memory is not freed one piece at a time : the old array is simply left behind
+		int capacity = max(64, rq.Capacity*2);
+		RenderItem* items = frameArena.allocArray<RenderItem>(capacity);
+		for (int i=0; i<rq.Count; i++)
+			items[i] = rq.Items[i];
+		rq.Items = items;
+		rq.Capacity = capacity;
+	}
+	rq.Items[rq.Count++] = item;
+}
+
+/* Start a new frame of draws, viewed through VP which shows [left,right]x[bottom,top] of the world */
+void beginRenderQueue (const glm::mat4& VP, float left, float right, float bottom, float top)
+{
+	renderQueue.VP = VP;
+	renderQueue.Left = left;
+	renderQueue.Right = right;
+	renderQueue.Bottom = bottom;
+	renderQueue.Top = top;
+	renderQueue.Submitted = 0;
+	renderQueue.Culled = 0;
+	for (int layer=0; layer<LAYER_COUNT; layer++)
+		renderQueue.Sequence[layer] = 0;
+	renderQueue.Items = NULL;
+	renderQueue.Count = 0;
+	renderQueue.Capacity = 0;
+	renderQueue.Order = NULL;
+}
+
+/* True if the bounding box of vao, placed by the 2D affine model matrix, misses the visible area */
+bool isCulled (struct VAO* vao, const glm::mat4& model)
+{
+	float minX = 1e30f, minY = 1e30f, maxX = -1e30f, maxY = -1e30f;
+	for (int corner=0; corner<4; corner++) {
+		float x = (corner & 1) ? vao->MaxX : vao->MinX;
+		float y = (corner & 2) ? vao->MaxY : vao->MinY;
+		float wx = model[0][0]*x + model[1][0]*y + model[3][0];
+		float wy = model[0][1]*x + model[1][1]*y + model[3][1];
+		minX = min(minX, wx);
+		maxX = max(maxX, wx);
+		minY = min(minY, wy);
+		maxY = max(maxY, wy);
+	}
+	return maxX < renderQueue.Left || minX > renderQueue.Right || maxY < renderQueue.Bottom || minY > renderQueue.Top;
+}
+
+/* Queue a draw of vao with the given model matrix, unless it is off screen */
+void submitDraw (int layer, struct VAO* vao, const glm::mat4& model, float depth=0)
+{
+	renderQueue.Submitted++;
+	if (isCulled(vao, model)) {
+		renderQueue.Culled++;
+		return;
+	}
+
+	RenderItem item;
+	item.Key = makeRenderKey(layer, depth, vao->Program, vao->VertexArrayID, renderQueue.Sequence[layer]++);
+	item.Vao = vao;
+	item.PrimitiveMode = vao->PrimitiveMode;
+	item.First = 0;
+	item.Count = drawCount(vao);
+	item.MVP = renderQueue.VP * model;
+	pushRenderItem(item);
+}
+
+/* Queue a draw of a mesh, nothing if it was released */
+void submitDraw (int layer, MeshHandle mesh, const glm::mat4& model, float depth=0)
+{
+	struct VAO* vao = getMesh(mesh);
+	if (vao != NULL)
+		submitDraw(layer, vao, model, depth);
+}
+
+/* Queue a draw of a range of vertices of vao, e.g. written to the stream buffer this frame */
+void submitDrawRange (int layer, struct VAO* vao, GLenum primitive_mode, int first, int count, const glm::mat4& model)
+{
+	// The bounds of a range are not known, it is never culled
+	renderQueue.Submitted++;
+	RenderItem item;
+	item.Key = makeRenderKey(layer, 0, vao->Program, vao->VertexArrayID, renderQueue.Sequence[layer]++);
+	item.Vao = vao;
+	item.PrimitiveMode = primitive_mode;
+	item.First = first;
+	item.Count = count;
+	item.MVP = renderQueue.VP * model;
+	pushRenderItem(item);
+}
+
+/* Queue a circle through the selected circle pipeline : triangle fan or SDF quad */
+void submitCircle (int layer, MeshHandle circle, const glm::mat4& model)
+{
+	struct VAO* vao = getMesh(circle);
+	if (vao == NULL)
+		return;
+	if (circle_pipeline == CIRCLE_SDF && getMesh(vao->SdfQuad) != NULL)
+		vao = getMesh(vao->SdfQuad);
+	submitDraw(layer, vao, model);
+}
+
+/* LSD radix sort of the item indices on their keys, 8 bits per pass.
+   Stable, so draws with equal keys keep their submission order.
+   Passes where every key has the same byte are skipped. */
+void sortRenderQueue ()
+{
+	PROFILE_ZONE("sort draws");
+	RenderItem* items = renderQueue.Items;
+	int n = renderQueue.Count;
+	int* order = frameArena.allocArray<int>(n);
+	int* scratch = frameArena.allocArray<int>(n); // radix sort ping-pong buffer
+	for (int i=0; i<n; i++)
+		order[i] = i;
+
+	for (int shift=0; shift<64; shift+=8) {
+		int count[257] = {0};
+		for (int i=0; i<n; i++)
+			count[((items[i].Key >> shift) & 0xFF) + 1]++;
+
+		bool single_bucket = false;
+		for (int b=1; b<=256; b++)
+			if (count[b] == n)
+				single_bucket = true;
+		if (single_bucket)
+			continue;
+
+		for (int b=0; b<256; b++)
+			count[b+1] += count[b];
+		for (int i=0; i<n; i++) {
+			int item = order[i];
+			scratch[count[(items[item].Key >> shift) & 0xFF]++] = item;
+		}
+		swap(order, scratch);
+	}
+	renderQueue.Order = order;
+}
+
+void flushStreamBuffer ();
+
+/* GPU time of each render pass, from GL_TIME_ELAPSED queries. The
+   queries of a frame are read GPU_TIMER_LATENCY frames later, when the
+   GPU is long done with them, so reading them never stalls. */
+enum GpuPass {
+	GPU_PASS_BACKGROUND,
+	GPU_PASS_PROPS,
+	GPU_PASS_STATIC_BLIT, // cached static layer copied to the screen
+	GPU_PASS_TARGETS,
+	GPU_PASS_BALLS,
+	GPU_PASS_CANON,
+	GPU_PASS_HUD,
+	GPU_PASS_COUNT
+};
+const char* gpu_pass_names[GPU_PASS_COUNT] = {
+	"gpu background", "gpu props", "gpu static layer", "gpu targets", "gpu balls", "gpu canon", "gpu hud"
+};
+
+#define GPU_TIMER_LATENCY 4
+
+struct GpuTimers {
+	bool Supported;
+	GLuint Queries[GPU_TIMER_LATENCY][GPU_PASS_COUNT];
+	bool Pending[GPU_TIMER_LATENCY][GPU_PASS_COUNT]; // issued, result not read yet
+	int Frame;  // query slot of the frame being drawn
+	int Active; // pass whose query is running, -1 if none
+
+	double LastMs[GPU_PASS_COUNT];  // latest result of each pass
+	double TotalMs[GPU_PASS_COUNT]; // sum and count since resetGpuTimers, for averages
+	int Samples[GPU_PASS_COUNT];
+	int Missed; // results still not available after GPU_TIMER_LATENCY frames, dropped
+} gpuTimers;
+
+int gpuPassOfLayer (int layer)
+{
+	switch (layer) {
+		case LAYER_SKY:
+		case LAYER_BACKGROUND: return GPU_PASS_BACKGROUND;
+		case LAYER_PROPS: return GPU_PASS_PROPS;
+		case LAYER_TARGETS: return GPU_PASS_TARGETS;
+		case LAYER_BALLS: return GPU_PASS_BALLS;
+		case LAYER_CANON: return GPU_PASS_CANON;
+		default: return GPU_PASS_HUD;
+	}
+}
+
+void resetGpuTimers ()
+{
+	for (int pass=0; pass<GPU_PASS_COUNT; pass++) {
+		gpuTimers.TotalMs[pass] = 0;
+		gpuTimers.Samples[pass] = 0;
+	}
+	gpuTimers.Missed = 0;
+}
+
+void initGpuTimers ()
+{
+	GpuTimers& gt = gpuTimers;
+	gt.Supported = GLAD_GL_VERSION_3_3 || GLAD_GL_ARB_timer_query;
+	if (gt.Supported)
+		glGenQueries (GPU_TIMER_LATENCY*GPU_PASS_COUNT, &gt.Queries[0][0]);
+	for (int slot=0; slot<GPU_TIMER_LATENCY; slot++)
+		for (int pass=0; pass<GPU_PASS_COUNT; pass++)
+			gt.Pending[slot][pass] = false;
+	for (int pass=0; pass<GPU_PASS_COUNT; pass++)
+		gt.LastMs[pass] = 0;
+	gt.Frame = 0;
+	gt.Active = -1;
+	resetGpuTimers();
+}
+
+/* Read the results of one slot. Without wait, results not available yet are dropped */
+void collectGpuTimers (int slot, bool wait)
+{
+	GpuTimers& gt = gpuTimers;
+	for (int pass=0; pass<GPU_PASS_COUNT; pass++) {
+		if (!gt.Pending[slot][pass])
+			continue;
+		gt.Pending[slot][pass] = false;
+
+		GLint available = 1;
+		if (!wait)
+			glGetQueryObjectiv (gt.Queries[slot][pass], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available) {
+			gt.Missed++;
+			continue;
+		}
+		GLuint64 ns = 0;
+		glGetQueryObjectui64v (gt.Queries[slot][pass], GL_QUERY_RESULT, &ns);
+		double ms = ns/1e6;
+		gt.LastMs[pass] = ms;
+		gt.TotalMs[pass] += ms;
+		gt.Samples[pass]++;
+		profileCounter(gpu_pass_names[pass], ms);
+	}
+}
+
+/* Move to the next query slot, reading what the GPU measured in it GPU_TIMER_LATENCY frames ago */
+void beginGpuFrame ()
+{
+	if (!gpuTimers.Supported)
+		return;
+	gpuTimers.Frame = (gpuTimers.Frame + 1) % GPU_TIMER_LATENCY;
+	collectGpuTimers(gpuTimers.Frame, false);
+}
+
+/* Wait for every result still pending, at the end of a benchmark */
+void finishGpuTimers ()
+{
+	if (!gpuTimers.Supported)
+		return;
+	for (int slot=0; slot<GPU_TIMER_LATENCY; slot++)
+		collectGpuTimers(slot, true);
+}
+
+/* Queries cannot nest : passes are timed one after the other, each once per frame */
+void beginGpuPass (int pass)
+{
+	GpuTimers& gt = gpuTimers;
+	if (!gt.Supported || gt.Active >= 0 || gt.Pending[gt.Frame][pass])
+		return;
+	glBeginQuery (GL_TIME_ELAPSED, gt.Queries[gt.Frame][pass]);
+	gt.Active = pass;
+}
+
+void endGpuPass ()
+{
+	GpuTimers& gt = gpuTimers;
+	if (gt.Active < 0)
+		return;
+	glEndQuery (GL_TIME_ELAPSED);
+	gt.Pending[gt.Frame][gt.Active] = true;
+	gt.Active = -1;
+}
+
+/* Render the sorted draws from position begin to end in the queue order */
+void executeRenderRange (int begin, int end)
+{
+	for (int i=begin; i<end; i++) {
+		RenderItem& item = renderQueue.Items[renderQueue.Order[i]];
+		RenderProgram& program = renderPrograms[item.Vao->Program];
+
+		stateUseProgram (program.ID);
+		stateBlend (program.Blend);
+		glUniformMatrix4fv(program.MatrixID, 1, GL_FALSE, &item.MVP[0][0]);
+		frameStats.UniformUploads++;
+		draw3DObject(item.Vao, item.PrimitiveMode, item.First, item.Count);
+	}
+}
+
+/* executeRenderRange, split in GPU timed passes where the layer changes pass */
+void executeTimedRange (int begin, int end)
+{
+	int i = begin;
+	while (i < end) {
+		int pass = gpuPassOfLayer(renderQueue.Items[renderQueue.Order[i]].Key >> 56);
+		int j = i+1;
+		while (j < end && gpuPassOfLayer(renderQueue.Items[renderQueue.Order[j]].Key >> 56) == pass)
+			j++;
+		beginGpuPass(pass);
+		executeRenderRange(i, j);
+		endGpuPass();
+		i = j;
+	}
+}
+
+/* Layers up to LAYER_PROPS only change with the camera. They are rendered
+   into a texture which is redrawn only when the visible area, the
+   framebuffer size or the circle pipeline change, and otherwise
+   composited with one fullscreen quad. */
+#define LAYER_STATIC_LAST LAYER_PROPS
+
+struct StaticLayerCache {
+	bool Enabled;
+	bool Valid;
+	GLuint Framebuffer;
+	GLuint ColorTexture;
+	GLuint DepthBuffer;
+	GLuint VertexArrayID; // empty, the quad is built in Sample_GL_static.vert
+	ResourceHandle Program;
+	GLuint ProgramID;
+
+	// What the texture was rendered for
+	int Width, Height;
+	float Left, Right, Bottom, Top;
+	int CirclePipeline;
+
+	int Redraws;   // times the texture was rendered
+} staticLayer;
+
+void initStaticLayer ()
+{
+	staticLayer.Valid = false;
+	staticLayer.Redraws = 0;
+	staticLayer.Width = staticLayer.Height = 0;
+	glGenFramebuffers (1, &staticLayer.Framebuffer);
+	glGenTextures (1, &staticLayer.ColorTexture);
+	glGenRenderbuffers (1, &staticLayer.DepthBuffer);
+	glGenVertexArrays (1, &staticLayer.VertexArrayID);
+
+	staticLayer.Program = createProgram( "Sample_GL_static.vert", "Sample_GL_static.frag" );
+	staticLayer.ProgramID = getResourceName(staticLayer.Program);
+	stateUseProgram (staticLayer.ProgramID);
+	glUniform1i (glGetUniformLocation(staticLayer.ProgramID, "staticLayer"), 0);
+	frameStats.UniformUploads++;
+}
+
+/* (Re)allocate the texture and depth buffer to the framebuffer size */
+void resizeStaticLayer (int width, int height)
+{
+	glBindTexture (GL_TEXTURE_2D, staticLayer.ColorTexture);
+	glTexImage2D (GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	glBindRenderbuffer (GL_RENDERBUFFER, staticLayer.DepthBuffer);
+	glRenderbufferStorage (GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+
+	glBindFramebuffer (GL_FRAMEBUFFER, staticLayer.Framebuffer);
+	glFramebufferTexture2D (GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, staticLayer.ColorTexture, 0);
+	glFramebufferRenderbuffer (GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, staticLayer.DepthBuffer);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		fprintf(stderr, "Static layer framebuffer incomplete, drawing it every frame\n");
+		staticLayer.Enabled = false;
+	}
+	glBindFramebuffer (GL_FRAMEBUFFER, 0);
+
+	staticLayer.Width = width;
+	staticLayer.Height = height;
+}
+
+/* Render the static draws [0,end) into the texture if it is out of date, then composite it */
+void drawStaticLayer (int end)
+{
+	StaticLayerCache& sl = staticLayer;
+	if (viewport_width <= 0 || viewport_height <= 0) // minimized
+		return;
+	if (sl.Width != viewport_width || sl.Height != viewport_height) {
+		resizeStaticLayer(viewport_width, viewport_height);
+		sl.Valid = false;
+		if (!sl.Enabled) {
+			executeTimedRange(0, end);
+			return;
+		}
+	}
+
+	if (!sl.Valid || sl.Left != renderQueue.Left || sl.Right != renderQueue.Right
+			|| sl.Bottom != renderQueue.Bottom || sl.Top != renderQueue.Top
+			|| sl.CirclePipeline != circle_pipeline) {
+		glBindFramebuffer (GL_FRAMEBUFFER, sl.Framebuffer);
+		glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		executeTimedRange(0, end);
+		glBindFramebuffer (GL_FRAMEBUFFER, 0);
+
+		sl.Left = renderQueue.Left;
+		sl.Right = renderQueue.Right;
+		sl.Bottom = renderQueue.Bottom;
+		sl.Top = renderQueue.Top;
+		sl.CirclePipeline = circle_pipeline;
+		sl.Valid = true;
+		sl.Redraws++;
+	}
+
+	// The quad covers the whole screen and must not hide the dynamic layers
+	stateUseProgram (sl.ProgramID);
+	stateBlend (false);
+	stateBindVertexArray (sl.VertexArrayID);
+	glBindTexture (GL_TEXTURE_2D, sl.ColorTexture);
+	glDisable (GL_DEPTH_TEST);
+	beginGpuPass(GPU_PASS_STATIC_BLIT);
+	glDrawArrays (GL_TRIANGLE_STRIP, 0, 4);
+	endGpuPass();
+	frameStats.DrawCalls++;
+	frameStats.Vertices += 4;
+	glEnable (GL_DEPTH_TEST);
+}
+
+/* Sort the queued draws and render them */
+void executeRenderQueue ()
+{
+	PROFILE_ZONE("execute draws");
+	sortRenderQueue();
+	flushStreamBuffer();
+
+	int n = renderQueue.Count;
+	int static_end = 0;
+	while (static_end < n && (renderQueue.Items[renderQueue.Order[static_end]].Key >> 56) <= LAYER_STATIC_LAST)
+		static_end++;
+
+	if (staticLayer.Enabled)
+		drawStaticLayer(static_end);
+	else
+		executeTimedRange(0, static_end);
+	executeTimedRange(static_end, n);
+}
+
+/* Ring buffer for vertex data rewritten every frame (trajectory preview, ...).
+   Vertices are interleaved : x,y,z, r,g,b.
+   The ring is split in STREAM_FRAMES regions, one per frame in flight.
+   With ARB_buffer_storage the whole ring is persistently mapped and the GPU
+   use of each region is tracked with a fence, so the CPU writes directly
+   into GL memory. Otherwise the buffer holds one region that is orphaned
+   with glBufferData(NULL) every frame and filled with glBufferSubData. */
+#define STREAM_FRAMES 3
+#define STREAM_STRIDE (6*sizeof(GLfloat))
+
+struct StreamBuffer {
+	struct VAO Vao;        // attributes point into Buffer, NumVertices is the region size
+	GLuint Buffer;
+	ResourceHandle Resource; // Buffer, owned by the resource manager
+	bool Persistent;
+	GLfloat* Mapped;       // persistent mapping of the whole ring
+	GLsync Fences[STREAM_FRAMES];
+	int Region;            // region written this frame
+	int Used;              // vertices written in the region this frame
+	vector<GLfloat> Staging; // CPU copy of the pending vertices when not persistent
+	int StagingFirst;
+	int Stalls;            // frames where the CPU had to wait for the GPU
+} streamBuffer;
+
+void initStreamBuffer (int regionVertices)
+{
+	StreamBuffer& sb = streamBuffer;
+	sb.Persistent = GLAD_GL_ARB_buffer_storage != 0;
+	sb.Mapped = NULL;
+	sb.Region = 0;
+	sb.Used = 0;
+	sb.StagingFirst = 0;
+	sb.Stalls = 0;
+	for (int i=0; i<STREAM_FRAMES; i++)
+		sb.Fences[i] = 0;
+
+	sb.Vao.PrimitiveMode = GL_TRIANGLES;
+	sb.Vao.FillMode = GL_FILL;
+	sb.Vao.NumVertices = regionVertices;
+	sb.Vao.NumIndices = 0;
+	sb.Vao.Program = PROGRAM_FLAT;
+	sb.Vao.SdfQuad = NO_RESOURCE;
+	sb.Vao.EnabledAttribs = 0;
+
+	glGenVertexArrays(1, &(sb.Vao.VertexArrayID));
+	glGenBuffers (1, &(sb.Buffer));
+	sb.Vao.VertexBuffer = sb.Buffer;
+	sb.Vao.ColorBuffer = 0;
+
+	stateBindVertexArray (sb.Vao.VertexArrayID);
+	glBindBuffer (GL_ARRAY_BUFFER, sb.Buffer);
+	if (sb.Persistent) {
+		GLsizeiptr size = STREAM_FRAMES * regionVertices * STREAM_STRIDE;
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage (GL_ARRAY_BUFFER, size, NULL, flags);
+		sb.Mapped = (GLfloat*) glMapBufferRange (GL_ARRAY_BUFFER, 0, size, flags);
+		if (sb.Mapped == NULL) {
+			// Storage is immutable, start over with a fresh buffer for orphaning
+			glDeleteBuffers (1, &(sb.Buffer));
+			glGenBuffers (1, &(sb.Buffer));
+			glBindBuffer (GL_ARRAY_BUFFER, sb.Buffer);
+			sb.Persistent = false;
+		}
+	}
+	if (!sb.Persistent) {
+		glBufferData (GL_ARRAY_BUFFER, regionVertices * STREAM_STRIDE, NULL, GL_STREAM_DRAW);
+		sb.Staging.resize(6 * regionVertices);
+	}
+	sb.Resource = registerBuffer(sb.Buffer, (sb.Persistent ? STREAM_FRAMES : 1) * regionVertices * STREAM_STRIDE);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, STREAM_STRIDE, (void*)0);
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, STREAM_STRIDE, (void*)(3*sizeof(GLfloat)));
+	stateEnableAttrib (&sb.Vao, 0);
+	stateEnableAttrib (&sb.Vao, 1);
+}
+
+/* Make the next region writable, waiting for the GPU only if it is 3 frames behind */
+void beginStreamFrame ()
+{
+	StreamBuffer& sb = streamBuffer;
+	sb.Used = 0;
+	sb.StagingFirst = 0;
+
+	if (!sb.Persistent) {
+		// Orphan : the driver hands out fresh storage if the old one is still in use
+		glBindBuffer (GL_ARRAY_BUFFER, sb.Buffer);
+		glBufferData (GL_ARRAY_BUFFER, sb.Vao.NumVertices * STREAM_STRIDE, NULL, GL_STREAM_DRAW);
+		return;
+	}
+
+	GLsync fence = sb.Fences[sb.Region];
+	if (fence) {
+		GLenum status = glClientWaitSync (fence, 0, 0);
+		if (status == GL_TIMEOUT_EXPIRED) {
+			sb.Stalls++;
+			while (status == GL_TIMEOUT_EXPIRED)
+				status = glClientWaitSync (fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+		}
+		glDeleteSync (fence);
+		sb.Fences[sb.Region] = 0;
+	}
+}
+
+/* Room for count vertices in this frame's region, or NULL if it is full.
+   *first receives the index of the first vertex, to draw them from sb.Vao.
+   The vertices must be written before the next streamReserve or endStreamFrame. */
+GLfloat* streamReserve (int count, int* first)
+{
+	StreamBuffer& sb = streamBuffer;
+	if (sb.Used + count > sb.Vao.NumVertices)
+		return NULL;
+
+	GLfloat* data;
+	if (sb.Persistent) {
+		*first = sb.Region * sb.Vao.NumVertices + sb.Used;
+		data = sb.Mapped + 6 * (*first);
+	}
+	else {
+		*first = sb.Used;
+		data = &sb.Staging[6 * sb.Used];
+	}
+	sb.Used += count;
+	frameStats.BytesUploaded += count * STREAM_STRIDE;
+	return data;
+}
+
+/* Upload the vertices reserved since the last flush, when not persistently mapped */
+void flushStreamBuffer ()
+{
+	StreamBuffer& sb = streamBuffer;
+	if (sb.Persistent || sb.Used == sb.StagingFirst)
+		return;
+	glBindBuffer (GL_ARRAY_BUFFER, sb.Buffer);
+	glBufferSubData (GL_ARRAY_BUFFER, sb.StagingFirst * STREAM_STRIDE, (sb.Used - sb.StagingFirst) * STREAM_STRIDE, &sb.Staging[6 * sb.StagingFirst]);
+	sb.StagingFirst = sb.Used;
+}
+
+/* Fence the region once the frame's draws are queued and move to the next one */
+void endStreamFrame ()
+{
+	StreamBuffer& sb = streamBuffer;
+	if (!sb.Persistent)
+		return;
+	sb.Fences[sb.Region] = glFenceSync (GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	sb.Region = (sb.Region + 1) % STREAM_FRAMES;
 }
 
 /**************************
@@ -235,14 +2625,139 @@ int score2=0;
 int score3=0;
 int over=0;
 double ay;
+bool redraw_requested = true; // a frame is needed even if the scene did not change (resize, expose)
+bool resumed_from_idle = false; // the next tick is the first after an idle wait
+/* Input event, stamped in the GLFW callback that recorded it */
+enum InputEventType { INPUT_KEY, INPUT_MOUSE_BUTTON, INPUT_SCROLL, INPUT_EVENT_TYPES };
+struct InputEvent {
+	int Type;
+	int Code;    // key or mouse button
+	int Action;  // GLFW_PRESS, GLFW_RELEASE or GLFW_REPEAT
+	double X, Y; // scroll offsets
+	double Time; // glfwGetTime() when the callback ran
+};
+
+/* Lock free single producer / single consumer ring.
+   The producer pushes, the consumer pops in the same order; neither side
+   ever waits. A push onto a full ring is refused and counted in Dropped. */
+template <typename T, unsigned int SIZE>
+struct SpscRing {
+	T Items[SIZE];                  // SIZE must be a power of two
+	std::atomic<unsigned int> Head; // next slot to write, producer owned
+	std::atomic<unsigned int> Tail; // next slot to read, consumer owned
+	unsigned int Dropped;
+
+	SpscRing () : Head(0), Tail(0), Dropped(0) {}
+
+	bool push (const T& item)
+	{
+		unsigned int head = Head.load(std::memory_order_relaxed);
+		if (head - Tail.load(std::memory_order_acquire) == SIZE) {
+			Dropped++;
+			return false;
+		}
+		Items[head & (SIZE-1)] = item;
+		Head.store(head+1, std::memory_order_release);
+		return true;
+	}
+
+	/* Oldest item, left in the ring, or NULL when empty */
+	const T* front () const
+	{
+		unsigned int tail = Tail.load(std::memory_order_relaxed);
+		if (tail == Head.load(std::memory_order_acquire))
+			return NULL;
+		return &Items[tail & (SIZE-1)];
+	}
+
+	bool pop (T& item)
+	{
+		const T* oldest = front();
+		if (oldest == NULL)
+			return false;
+		item = *oldest;
+		Tail.store(Tail.load(std::memory_order_relaxed)+1, std::memory_order_release);
+		return true;
+	}
+
+	bool empty () const
+	{
+		return Tail.load(std::memory_order_acquire) == Head.load(std::memory_order_acquire);
+	}
+};
+
+/* The GLFW callbacks push, update() pops everything pending at the start
+   of each tick, so a press and release or several scroll ticks between
+   two ticks are all applied, in order. */
+SpscRing<InputEvent, 1024> inputQueue;
+
+/* One input event followed until its result is on screen. The
+   simulation stamps Input and Tick, the render thread the rest. */
+struct LatencySample {
+	int Type;           // InputEventType
+	unsigned int TickId; // sim_tick that applied the event
+	double Input;       // GLFW callback
+	double Tick;        // update() applied it
+	double Render;      // render thread started the first frame showing it
+	double Swap;        // glfwSwapBuffers returned for that frame
+	double Gpu;         // fence after the swap signalled, polled so an upper bound
+};
+
+unsigned int sim_tick = 0; // number of update() calls so far
+SpscRing<LatencySample, 1024> latencyQueue; // simulation to render thread
+
+void pushInputEvent (int type, int code, int action, double x, double y)
+{
+	InputEvent event;
+	event.Type = type;
+	event.Code = code;
+	event.Action = action;
+	event.X = x;
+	event.Y = y;
+	event.Time = glfwGetTime();
+	inputQueue.push(event);
+}
+
 /* Executed when a regular key is pressed/released/held-down */
 /* Prefered for Keyboard events */
+void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+	if (action == GLFW_PRESS && key == GLFW_KEY_ESCAPE) {
+		cout << "GAME OVER! " << endl;
+		cout << "SCORE : " << score << endl;
+		quit(window);
+		return;
+	}
+	pushInputEvent(INPUT_KEY, key, action, 0, 0);
+}
 
-void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
+/* Executed for character input (like in text boxes) */
+void keyboardChar (GLFWwindow* window, unsigned int key)
+{
+	switch (key) {
+		case 'Q':
+		case 'q':
+			quit(window);
+			break;
+		default:
+			break;
+	}
+}
+/* Executed when a mouse button is pressed/released */
+void mouseButton (GLFWwindow* window, int button, int action, int mods)
 {
-	// Function is called first on GLFW_PRESS.
+	pushInputEvent(INPUT_MOUSE_BUTTON, button, action, 0, 0);
+}
 
+/* Executed when the mouse wheel or touchpad scrolls */
+void scroll (GLFWwindow *window, double x, double y)
+{
+	pushInputEvent(INPUT_SCROLL, 0, 0, x, y);
+}
 
+/* The apply functions below run from update(), one call per queued event */
+void applyKeyEvent (int key, int action)
+{
 	if (action == GLFW_RELEASE) {
 		switch (key) {
 			case GLFW_KEY_C:
@@ -296,12 +2811,20 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
 	}
 	else if (action == GLFW_PRESS) {
 		switch (key) {
-			case GLFW_KEY_ESCAPE:
-				cout << "GAME OVER! " << endl;
-				cout << "SCORE : " << score << endl;
-				quit(window);
+			case GLFW_KEY_O:
+				show_stats = !show_stats;
+				break;
+			case GLFW_KEY_T:
+				// First press starts a capture, the next one writes it out
+				if (profiler.Capturing)
+					writeChromeTrace(trace_path.c_str());
+				else
+					startProfiling();
+				break;
+			case GLFW_KEY_V:
+				// Applied by the renderer, which owns the GL context
+				pacing_mode = (pacing_mode + 1) % PACING_COUNT;
 				break;
-
 			case GLFW_KEY_A:
 				rot_a=1;
 				//can_x=-12 + 2*cos(DEG2RAD(canon_rotation + atan(0.5/2)));
@@ -316,8 +2839,7 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
 				if (flag==0)
 				{
 					angle = canon_rotation;
-					can_x=-12 + 2*cos(DEG2RAD(angle + atan(0.5/2)));
-					can_y = -6.5 + 2*sin(DEG2RAD(angle + atan(0.5/2)));
+					canonMouth(angle, &can_x, &can_y);
 					flag=1;
 				}
 				break;
@@ -347,23 +2869,10 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
 	}
 }
 
-/* Executed for character input (like in text boxes) */
-void keyboardChar (GLFWwindow* window, unsigned int key)
-{
-	switch (key) {
-		case 'Q':
-		case 'q':
-			quit(window);
-			break;
-		default:
-			break;
-	}
-}
 int right_click=0;
 int scroll_left=0;
 int scroll_right=0;
-/* Executed when a mouse button is pressed/released */
-void mouseButton (GLFWwindow* window, int button, int action, int mods)
+void applyMouseButtonEvent (int button, int action)
 {
 	switch (button) {
 		case GLFW_MOUSE_BUTTON_LEFT:
@@ -372,8 +2881,7 @@ void mouseButton (GLFWwindow* window, int button, int action, int mods)
 				if (flag==0)
 				{
 					angle = canon_rotation;
-					can_x=-12 + 2*cos(DEG2RAD(angle + atan(0.5/2)));
-					can_y = -6.5 + 2*sin(DEG2RAD(angle + atan(0.5/2)));
+					canonMouth(angle, &can_x, &can_y);
 					flag=1;
 					flag_f=0;
 				}
@@ -400,23 +2908,19 @@ void mouseButton (GLFWwindow* window, int button, int action, int mods)
 			break;
 	}
 }
-int scroll_up=0;
-int scroll_down=0;
-//int scroll_left=0;
-//int scroll_right=0;
-void scroll ( GLFWwindow *window , double x, double y)
+int scroll_zoom=0; // scroll ticks not yet applied to the camera, positive zooms in
+void applyScrollEvent (double x, double y)
 {
 	float p,g;	
 	p=float(y)/4;
 	g=float(x)/4;
-	cout << g;
 	if ( p<0 )
 	{
-		scroll_down=1;
+		scroll_zoom--;
 	}
 	if (p>0 )
 	{
-		scroll_up=1;
+		scroll_zoom++;
 	}
 	if ( g>0 )
 	{
@@ -426,11 +2930,64 @@ void scroll ( GLFWwindow *window , double x, double y)
 	{
 		scroll_right=1;
 	}
-	//float g;
-	//g=float(x)/4;
-	//cout << g;
+}
+
+/* Apply every queued input event, oldest first */
+/* A key pressed and released between two ticks must still be down for
+   one update() : its release is held back and applied at the start of
+   the next tick. Pressing it again meanwhile cancels the held release. */
+#define MAX_HELD_RELEASES 16
+int held_releases[MAX_HELD_RELEASES];
+int held_release_count = 0;
+
+void drainInputEvents ()
+{
+	PROFILE_ZONE("input");
+	double now = glfwGetTime();
+
+	// Released before anything queued now
+	for (int i=0; i<held_release_count; i++)
+		applyKeyEvent(held_releases[i], GLFW_RELEASE);
+	held_release_count = 0;
+
+	int pressed[MAX_HELD_RELEASES]; // keys pressed during this tick
+	int pressed_count = 0;
+	InputEvent event;
+	while (inputQueue.pop(event)) {
+		switch (event.Type) {
+			case INPUT_KEY:
+				if (event.Action == GLFW_PRESS) {
+					int* held = find(held_releases, held_releases + held_release_count, event.Code);
+					if (held != held_releases + held_release_count)
+						*held = held_releases[--held_release_count];
+					if (pressed_count < MAX_HELD_RELEASES)
+						pressed[pressed_count++] = event.Code;
+				}
+				else if (event.Action == GLFW_RELEASE && held_release_count < MAX_HELD_RELEASES
+						&& find(pressed, pressed + pressed_count, event.Code) != pressed + pressed_count) {
+					held_releases[held_release_count++] = event.Code;
+					break;
+				}
+				applyKeyEvent(event.Code, event.Action);
+				break;
+			case INPUT_MOUSE_BUTTON:
+				applyMouseButtonEvent(event.Code, event.Action);
+				break;
+			case INPUT_SCROLL:
+				applyScrollEvent(event.X, event.Y);
+				break;
+		}
 
+		LatencySample sample;
+		sample.Type = event.Type;
+		sample.TickId = sim_tick;
+		sample.Input = event.Time;
+		sample.Tick = now;
+		sample.Render = sample.Swap = sample.Gpu = 0;
+		latencyQueue.push(sample);
+	}
 }
+
 //int up=0;
 /* Executed when window is resized to 'width' and 'height' */
 /* Modify the bounds of the screen here in glm::ortho or Field of View in glm::Perspective */
@@ -443,8 +3000,10 @@ void reshapeWindow (GLFWwindow* window, int width, int height)
 
 	GLfloat fov = 90.0f;
 
-	// sets the viewport of openGL renderer
-	glViewport (0, 0, (GLsizei) fbwidth, (GLsizei) fbheight);
+	// the renderer sets the viewport of openGL from these
+	fb_width = fbwidth;
+	fb_height = fbheight;
+	redraw_requested = true;
 
 	// set the projection matrix as perspective
 	/* glMatrixMode (GL_PROJECTION);
@@ -475,15 +3034,14 @@ void reshapeWindow (GLFWwindow* window, int width, int height)
 		Matrices.projection = glm::ortho(lx, rx, dy, uy, 0.1f, 500.0f);
 		}*/
 	}
-VAO *triangle, *rectangle;
-VAO *circle;
-VAO *base, *canon;
-VAO *ground, *sky;
-VAO *ball1;
-VAO *stick, *stand;
-VAO *target1, *target2, *target3;
-VAO *triangle1, *triangle2;
-VAO *fly, *arrow, *speedbar;
+MeshHandle circle;
+MeshHandle base, canon;
+MeshHandle ground, sky;
+MeshHandle ball1;
+MeshHandle stick, stand;
+MeshHandle target1, target2, target3;
+MeshHandle triangle1, triangle2;
+MeshHandle fly, arrow, speedbar;
 // Creates the triangle object used in this sample code
 
 void createTriangle1 ()
@@ -529,155 +3087,88 @@ void createTriangle2 ()
 }
 
 
-void createCircle(float radius, float cirx, float ciry)
-
+/* Triangle fan of a circle in one color, with its SDF quad */
+MeshHandle createFanCircle (float radius, GLfloat red, GLfloat green, GLfloat blue)
 {
-	GLfloat* vertex_buffer_data = new GLfloat [3*360];
-	GLfloat* color_buffer_data = new GLfloat [3*360];
+	MeshHandle mesh = createShape(circleShape(radius, red, green, blue));
+	setSdfQuad(mesh, createSdfQuad(radius, red, green, blue));
+	return mesh;
+}
 
-	for (int i=0; i<360; i++)
-	{
-		vertex_buffer_data [3*i] = (radius * cos(DEG2RAD(i)));
-		vertex_buffer_data [3*i + 1] = (radius * sin(DEG2RAD(i)));
-		vertex_buffer_data [3*i +2] = 0;
+void createCircle(float radius, float cirx, float ciry)
 
-		color_buffer_data [3*i] = 0.5;
-		color_buffer_data [3*i + 1] = 0.2;
-		color_buffer_data [3*i + 2] = 0.05;
-	}
-	circle =  create3DObject(GL_TRIANGLE_FAN, 360, vertex_buffer_data, color_buffer_data, GL_FILL);
+{
+	circle = createFanCircle(radius, 0.5, 0.2, 0.05);
 }
 
 void createBall1(float radius, float cirx, float ciry)
 
 {
-	GLfloat* vertex_buffer_data = new GLfloat [3*360];
-	GLfloat* color_buffer_data = new GLfloat [3*360];
-
-	for (int i=0; i<360; i++)
-	{
-		vertex_buffer_data [3*i] = (radius * cos(DEG2RAD(i)));
-		vertex_buffer_data [3*i + 1] = (radius * sin(DEG2RAD(i)));
-		vertex_buffer_data [3*i +2] = 0;
-
-		color_buffer_data [3*i] = 0.5;
-		color_buffer_data [3*i + 1] = 0.2;
-		color_buffer_data [3*i + 2] = 0.5;
-	}
-	ball1 =  create3DObject(GL_TRIANGLE_FAN, 360, vertex_buffer_data, color_buffer_data, GL_FILL);
+	ball1 = createFanCircle(radius, 0.5, 0.2, 0.5);
 }
 
 void createTarget1(float radius, float cirx, float ciry)
 
 {
-	GLfloat* vertex_buffer_data = new GLfloat [3*360];
-	GLfloat* color_buffer_data = new GLfloat [3*360];
-
-	for (int i=0; i<360; i++)
-	{
-		vertex_buffer_data [3*i] = (radius * cos(DEG2RAD(i)));
-		vertex_buffer_data [3*i + 1] = (radius * sin(DEG2RAD(i)));
-		vertex_buffer_data [3*i +2] = 0;
-
-		color_buffer_data [3*i] = 0;
-		color_buffer_data [3*i + 1] = 0;
-		color_buffer_data [3*i + 2] = 0;
-	}
-	target1 =  create3DObject(GL_TRIANGLE_FAN, 360, vertex_buffer_data, color_buffer_data, GL_FILL);
+	target1 = createFanCircle(radius, 0, 0, 0);
 }
 
 void createTarget2(float radius, float cirx, float ciry)
 
 {
-	GLfloat* vertex_buffer_data = new GLfloat [3*360];
-	GLfloat* color_buffer_data = new GLfloat [3*360];
-
-	for (int i=0; i<360; i++)
-	{
-		vertex_buffer_data [3*i] = (radius * cos(DEG2RAD(i)));
-		vertex_buffer_data [3*i + 1] = (radius * sin(DEG2RAD(i)));
-		vertex_buffer_data [3*i +2] = 0;
-
-		color_buffer_data [3*i] = 0;
-		color_buffer_data [3*i + 1] = 0;
-		color_buffer_data [3*i + 2] = 0;
-	}
-	target2 =  create3DObject(GL_TRIANGLE_FAN, 360, vertex_buffer_data, color_buffer_data, GL_FILL);
+	target2 = createFanCircle(radius, 0, 0, 0);
 }
 
 void createTarget3(float radius, float cirx, float ciry)
 
 {
-	GLfloat* vertex_buffer_data = new GLfloat [3*360];
-	GLfloat* color_buffer_data = new GLfloat [3*360];
-
-	for (int i=0; i<360; i++)
-	{
-		vertex_buffer_data [3*i] = (radius * cos(DEG2RAD(i)));
-		vertex_buffer_data [3*i + 1] = (radius * sin(DEG2RAD(i)));
-		vertex_buffer_data [3*i +2] = 0;
-
-		color_buffer_data [3*i] = 0;
-		color_buffer_data [3*i + 1] = 0;
-		color_buffer_data [3*i + 2] = 0;
-	}
-	target3 =  create3DObject(GL_TRIANGLE_FAN, 360, vertex_buffer_data, color_buffer_data, GL_FILL);
+	target3 = createFanCircle(radius, 0, 0, 0);
 }
 
 // Creates the rectangle object used in this sample code
 
 void createGround ()
 {
-	// GL3 accepts only Triangles. Quads are not supported
+	// GL3 accepts only Triangles. Quads are not supported : the 4 corners are
+	// drawn as 2 triangles through the shared quad indices
 	static const GLfloat vertex_buffer_data [] = {
 		-16,-7.75,0, // vertex 1
 		-16,-8,0, // vertex 2
 		16,-8,0, // vertex 3
-
-		16,-8,0, // vertex 3
-		16,-7.75,0, // vertex 4
-		-16,-7.75,0  // vertex 1
+		16,-7.75,0  // vertex 4
 	};
 
 	static const GLfloat color_buffer_data [] = {
 		0,0,0, // color 1
 		0,0,0, // color 2
 		0,0,0, // color 3
-
-		0,0,0, // color 3
-		0,0,0, // color 4
-		0,0,0  // color 1
+		0,0,0  // color 4
 	};
 
 	// create3DObject creates and returns a handle to a VAO that can be used later
-	ground = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+	ground = create3DObject(GL_TRIANGLES, 4, vertex_buffer_data, color_buffer_data, GL_FILL, INDEX_QUADS);
 }
 
 void createSky ()
 {
-	// GL3 accepts only Triangles. Quads are not supported
+	// GL3 accepts only Triangles. Quads are not supported : the 4 corners are
+	// drawn as 2 triangles through the shared quad indices
 	static const GLfloat vertex_buffer_data [] = {
 		-16,8,0, // vertex 1
 		-16,-3,0, // vertex 2
 		16,-3,0, // vertex 3
-
-		16,-3,0, // vertex 3
-		16,8,0, // vertex 4
-		-16,8,0  // vertex 1
+		16,8,0  // vertex 4
 	};
 
 	static const GLfloat color_buffer_data [] = {
 		0,1,1, // color 1
 		1,1,1, // color 2
 		1,1,1, // color 3
-
-		1,1,1, // color 3
-		0,1,1, // color 4
-		0,1,1  // color 1
+		0,1,1  // color 4
 	};
 
 	// create3DObject creates and returns a handle to a VAO that can be used later
-	sky = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+	sky = create3DObject(GL_TRIANGLES, 4, vertex_buffer_data, color_buffer_data, GL_FILL, INDEX_QUADS);
 }
 
 void createSpeedbar()
@@ -686,170 +3177,130 @@ void createSpeedbar()
 		-15, 5, 0,
 		-15, 0, 0,
 		-14.25, 0, 0,
-
-		-14.25, 0, 0,
-		-14.25, 5, 0,
-		-15, 5, 0
+		-14.25, 5, 0
 	};
 	static const GLfloat color_buffer_data [] = {
 		1,0,0,
 		0,1,0,
 		0,1,0,
-
-		0,1,0,
-		1,0,0,
 		1,0,0
 	};
 
-	speedbar = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+	speedbar = create3DObject(GL_TRIANGLES, 4, vertex_buffer_data, color_buffer_data, GL_FILL, INDEX_QUADS);
 }
 
 void createBase ()
 {
-	// GL3 accepts only Triangles. Quads are not supported
+	// GL3 accepts only Triangles. Quads are not supported : the 4 corners are
+	// drawn as 2 triangles through the shared quad indices
 	static const GLfloat vertex_buffer_data [] = {
 		-11.25,-7.25,0, // vertex 1
 		-11.25,-7.75,0, // vertex 2
 		-12.75, -7.75,0, // vertex 3
-
-		-12.75, -7.75,0, // vertex 3
-		-12.75, -7.25,0, // vertex 4
-		-11.25,-7.25,0  // vertex 1
+		-12.75, -7.25,0  // vertex 4
 	};
 
 	static const GLfloat color_buffer_data [] = {
 		0.5,0.2,0.05, // color 1
 		0.5,0.2,0.05, // color 2
 		0.5,0.2,0.05, // color 3
-
-		0.5,0.2,0.05, // color 3
-		0.5,0.2,0.05, // color 4
-		0.5,0.2,0.05  // color 1
+		0.5,0.2,0.05  // color 4
 	};
 
 	// create3DObject creates and returns a handle to a VAO that can be used later
-	base = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+	base = create3DObject(GL_TRIANGLES, 4, vertex_buffer_data, color_buffer_data, GL_FILL, INDEX_QUADS);
 }
 
 void createFly ()
 {
-	// GL3 accepts only Triangles. Quads are not supported
+	// GL3 accepts only Triangles. Quads are not supported : the 4 corners are
+	// drawn as 2 triangles through the shared quad indices
 	static const GLfloat vertex_buffer_data [] = {
 		7,3.25,0, // vertex 1
 		11,3.25,0, // vertex 2
 		11, 2.75,0, // vertex 3
-
-		11, 2.75,0, // vertex 3
-		7, 2.75,0, // vertex 4
-		7,3.25,0  // vertex 1
+		7, 2.75,0  // vertex 4
 	};
 
 	static const GLfloat color_buffer_data [] = {
 		0.5,0.2,0.05, // color 1
 		0.5,0.2,0.05, // color 2
 		0.5,0.2,0.05, // color 3
-
-		0.5,0.2,0.05, // color 3
-		0.5,0.2,0.05, // color 4
-		0.5,0.2,0.05  // color 1
+		0.5,0.2,0.05  // color 4
 	};
 
 	// create3DObject creates and returns a handle to a VAO that can be used later
-	fly = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+	fly = create3DObject(GL_TRIANGLES, 4, vertex_buffer_data, color_buffer_data, GL_FILL, INDEX_QUADS);
 }
 
 void createStick ()
 {
-	// GL3 accepts only Triangles. Quads are not supported
+	// GL3 accepts only Triangles. Quads are not supported : the 4 corners are
+	// drawn as 2 triangles through the shared quad indices
 	static const GLfloat vertex_buffer_data [] = {
 		0,0,0, // vertex 1
 		-1,0,0, // vertex 2
 		-1,4,0, // vertex 3
-
-		-1,4,0, // vertex 3
-		0,4, 0, // vertex 4
-		0,0,0,  // vertex 5
-
+		0,4, 0  // vertex 4
 	};
 
 	static const GLfloat color_buffer_data [] = {
 		0.5,0.2,0.05, // color 1
 		0.5,0.2,0.05, // color 2
 		0.5,0.2,0.05, // color 3
-
-		0.5,0.2,0.05, // color 3
-		0.5,0.2,0.05, // color 4
-		0.5,0.2,0.05,  // color 1
-
+		0.5,0.2,0.05  // color 4
 	};
 
 	// create3DObject creates and returns a handle to a VAO that can be used later
-	stick = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+	stick = create3DObject(GL_TRIANGLES, 4, vertex_buffer_data, color_buffer_data, GL_FILL, INDEX_QUADS);
 }
 
 void createStand ()
 {
-	// GL3 accepts only Triangles. Quads are not supported
+	// GL3 accepts only Triangles. Quads are not supported : the 4 corners are
+	// drawn as 2 triangles through the shared quad indices
 	static const GLfloat vertex_buffer_data [] = {
 		0,0,0, // vertex 1
 		0,2,0, // vertex 2
 		3,2,0, // vertex 3
-
-		3,2,0, // vertex 3
-		5,0,0, // vertex 4
-		0,0,0,  // vertex 5
-
+		5,0,0  // vertex 4
 	};
 
 	static const GLfloat color_buffer_data [] = {
 		0.5,0.2,0.05, // color 1
 		0.5,0.2,0.05, // color 2
 		0.5,0.2,0.05, // color 3
-
-		0.5,0.2,0.05, // color 3
-		0.5,0.2,0.05, // color 4
-		0.5,0.2,0.05,  // color 1
-
+		0.5,0.2,0.05  // color 4
 	};
 
 	// create3DObject creates and returns a handle to a VAO that can be used later
-	stand = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+	stand = create3DObject(GL_TRIANGLES, 4, vertex_buffer_data, color_buffer_data, GL_FILL, INDEX_QUADS);
 }
 void createArrow()
 {
+	// Convex outline, from the tail around the point : drawn through the shared fan indices
 	static const GLfloat vertex_buffer_data [] = {
 		-1.5, -0.25, 0,
+		-1.75, 0, 0,
 		-1.5, 0.25, 0,
 		0, 0.25, 0,
-
-		0, 0.25, 0,
-		0, -0.25, 0,
-		-1.5, -0.25, 0,
-
-		-1.5, -0.25, 0,
-		-1.75, 0, 0,
-		-1.5, 0.25, 0	
+		0, -0.25, 0
 	};
 
 	static const GLfloat color_buffer_data [] = {
 		0,0,0,
 		0,0,0,
-		0,0,0,
-
-		0,0,0,
-		0,0,0,
-		0,0,0,
-
 		0,0,0,
 		0,0,0,
 		0,0,0
 	};
-	arrow = create3DObject(GL_TRIANGLES, 9, vertex_buffer_data, color_buffer_data, GL_FILL);
+	arrow = create3DObject(GL_TRIANGLES, 5, vertex_buffer_data, color_buffer_data, GL_FILL, INDEX_FAN);
 }
 
 void createCanon ()
 {
-	// GL3 accepts only Triangles. Quads are not supported
+	// GL3 accepts only Triangles. Quads are not supported : the 4 corners are
+	// drawn as 2 triangles through the shared quad indices
 	static const GLfloat vertex_buffer_data [] = {
 		/* -12,-6.75,0, // vertex 1
 		   -12,-6.25,0, // vertex 2
@@ -862,24 +3313,18 @@ void createCanon ()
 		0,0,0,
 		0,0.5,0,
 		2,0.5,0,
-
-		2,0.5,0,
-		2,0,0,
-		0,0,0
+		2,0,0
 	};
 
 	static const GLfloat color_buffer_data [] = {
 		0.5,0.2,0.05, // color 1
 		0.5,0.2,0.05, // color 2
 		0.5,0.2,0.05, // color 3
-
-		0.5,0.2,0.05, // color 3
-		0.5,0.2,0.05, // color 4
-		0.5,0.2,0.05  // color 1
+		0.5,0.2,0.05  // color 4
 	};
 
 	// create3DObject creates and returns a handle to a VAO that can be used later
-	canon = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+	canon = create3DObject(GL_TRIANGLES, 4, vertex_buffer_data, color_buffer_data, GL_FILL, INDEX_QUADS);
 }
 
 float camera_rotation_angle = 90;
@@ -897,19 +3342,47 @@ float rx=16.0;
 float dy=-8.0;
 float upy=8.0;
 int theta;
-double ux=u*cos(DEG2RAD(theta));
-double uy=u*sin(DEG2RAD(theta));
-double vx=v*cos(DEG2RAD(theta));
-double vy=v*sin(DEG2RAD(theta));
+double ux=u*cosDeg(theta);
+double uy=u*sinDeg(theta);
+double vx=v*cosDeg(theta);
+double vy=v*sinDeg(theta);
 int yay = 0;
 int haha=0;
 int arrowy;
 //int x,y;
 //float canon_rotation = 0;
-/* Render the scene with openGL */
-/* Edit this function according to your assignment */
-void draw ()
+
+/* Everything the render thread needs to draw one frame. The simulation
+   fills one per tick and hands it over through the frameHandoff triple buffer */
+struct FrameSnapshot {
+	float lx, rx, dy, upy;  // camera bounds
+	int fb_width, fb_height;
+	double canon_rotation;
+	double ay;              // height of the speed arrow
+	int t1, t2, t3;         // targets still standing
+	int flag;               // ball state, 0 while aiming
+	bool ball_visible;
+	double ball_x, ball_y;
+	int score;
+	float triangle_rotation, rectangle_rotation; // only for the unused transforms, not part of the scene
+	int pacing_mode;
+	double target_fps;
+	unsigned int tick;      // sim_tick of the state, not part of the scene
+	double time;            // glfwGetTime() when filled, not part of the scene
+	bool after_idle;        // first tick after an idle wait, not part of the scene
+};
+
+bool ball_visible = false;
+double ball_x, ball_y; // ball position shown this tick
+
+/* Advance the game by one tick : inputs, camera, ball and collisions */
+void update ()
 {
+	PROFILE_ZONE("update");
+	HwCounterScope hw_counters(HW_SIM_TICK);
+	sim_tick++;
+	drainInputEvents();
+
 	if (canon_rotation<=90 && rot_a==1)
 	{
 
@@ -933,97 +3406,288 @@ void draw ()
 
 
 		}*/
-	if ( up==1 || scroll_up==1)
+	// Held keys zoom one step per tick, every scroll tick one more step
+	int zoom_steps = up - down + scroll_zoom;
+	scroll_zoom = 0;
+	for (; zoom_steps > 0; zoom_steps--)
 	{
 		lx+=0.1;
 		rx-=0.1;
 		dy+=0.1;
 		upy-=0.1;
-		scroll_up=0;
-
 	}
-	if (down==1 || scroll_down==1)
+	for (; zoom_steps < 0; zoom_steps++)
 	{
 		lx-=0.1;
 		rx+=0.1;
 		dy-=0.1;
 		upy+=0.1;
-		scroll_down=0;
 	}
 
+	if (panleft==1 || (right_click==1 && scroll_right==1))
+	{
+		lx-=0.1;
+		rx-=0.1;
+	}
+	if (panright==1 || (right_click==1 && scroll_left==1))
+	{
+		lx+=0.1;
+		rx+=0.1;
+	}	
+	ball_visible = false;
+	if (flag==1 || flag==2)
+	{
+		PROFILE_ZONE("ball flight");
+		gaga=0;
+		haha=0;
+		//ay=0;
+		//	cout<<"boo"<<endl;
+		bx=can_x + pos_x;
+		by=can_y + pos_y;
+		ball_visible = true;
+		ball_x = bx;
+		ball_y = by;
+
+		if(flag == 1)
+		{
+			start_t = glfwGetTime();
+			flag ++;
+				ay=0;
+		}
+		curr_t=glfwGetTime();
+		t=curr_t-start_t;
+		//theta=canon_rotation;
+		//	cout << pos_x << endl;
+		//	cout << pos_y << endl;
+		//		draw3DObject(ball1);
+		/*	if (gaga==1)
+			pos_x=-1*u*(cos(DEG2RAD(angle)))*t;
+			else*/
+		pos_x=u*(cosDeg(angle))*t;
+
+		if (by>-7.25)
+			pos_y=u*(sinDeg(angle))*t - 0.5*9.8*t*t;
+		if (bx>16.0 || by<-8.0 || by>8.0 || bx<-16.0)
+		{
+			//		cout<<"yo"<<endl;
+			flag=0;
+			u=5;
+			pos_x=0;
+			pos_y=0;
+			//	start_t=glfwGetTime();
+		}
+		if (by<=-7.25 )
+		{
+			int lala;
+			lala=u - 0.1*9.8*t;
+
+			//	cout << "this";
+			//	cout << by << endl;
+			by=pos_y;
+			pos_x=u*cosDeg(0)*t - 0.5*0.1*9.8*t*t;
+			//	cout << "u";
+			//	cout << lala << endl;
+			if (lala<-.02)
+			{
+				bx=19.0;
+				by=-10;
+				pos_x=0;
+				pos_y=0;
+			}
+
+		}
+		// The zone lasts to the end of the flight block, only comments follow
+		PROFILE_ZONE("collision");
+		if( (((bx)*(bx) +(by+3.25)*(by+3.25))*((bx)*(bx) +(by+3.25)*(by+3.25))) <=1.5625   )
+		{
+			if (t1=1)
+				score1=1;
+			t1=0;
+
+			//score+=1;
+			//cout << score << endl;
+		}
+		if( bx>6.75 && bx<9.25 && by<-3.75 && by>-6.25)
+		{
+			if (t2=1)
+				score2=1;
+			t2=0;
+			//score+=1;
+			//cout << score << endl; 
+		}
+		if( (((bx-9)*(bx-9) +(by-4)*(by-4))*((bx-9)*(bx-9) +(by-4)*(by-4))) <=1.5625   )
+		{
+			if (t3=1)
+				score3=1;
+			t3=0;
+			//score+=1;
+			//cout << score;
+		}
+		score=score1+score2+score3;
+		//int haha=0;
+		if (score==3)
+		{
+			over=1;
+		}
+
+		if ((bx >=-2 && bx<=1 && by<=-4 && by>=-6) || (by>=2.75 && by<=3.25 && bx>=7 && bx<=11) || (bx>=12 && bx<=13 && by >=-6 && by<=-2))
+		{
+			if (haha=0)
+			{	can_x=0;
+				can_y=0;
+				start_t=glfwGetTime();
+				haha=1;
+			}
+			curr_t=glfwGetTime();
+			//	t=curr_t-start_t;
+			//can_x=0
+			pos_x=-1*u*cosDeg(angle)*t;
+			pos_y=u*(sinDeg(angle))*t - 0.5*9.8*t*t;
+			gaga=1;
+		}
+		/*	if (bx>=-2 && bx<=1 && by>=-6 && by<=-4)
+			{
+			can_x=bx;
+			can_y=by;
+		//draw3Dobject(ball1);
+		curr_t = glfwGetTime();
+		start_t = glfwGetTime();
+		t=curr_t - start_t;
+
+		pos_x = u*cos(DEG2RAD(canon_rotation))*t;
+		pos_y = u*sin(DEG2RAD(canon_rotation))*t - 0.5*9.8*t*t;
+
+		u*=1;
+		}
+		 */
+
+		/*		if ( bx>=-1.5 && by>=-6 && by<=-4 && yay!=1)
+
+				{
+		//			start_t=glfwGetTime();
+		cout << "GRUEUGRGFUGFRWUGRYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYU" << endl;
+		cout << bx << endl;
+		cout << by << endl;
+		cout << pos_x << endl;
+		cout << pos_y << endl;
 
-	if (panleft==1 || (right_click==1 && scroll_right==1))
-	{
-		lx-=0.1;
-		rx-=0.1;
-	}
-	if (panright==1 || (right_click==1 && scroll_left==1))
-	{
-		lx+=0.1;
-		rx+=0.1;
-	}	
-	Matrices.projection = glm::ortho(lx, rx, dy, upy, 0.1f, 500.0f);
+		yay = 1;
+		gaga=1;
+		pos_x=0;
+		pos_y=0;
 
-	// clear the color and depth in the frame buffer
-	glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		can_x=-1.5;
+		can_y=by;
 
-	// use the loaded shader program
-	// Don't change unless you know what you are doing
-	glUseProgram (programID);
 
-	// Eye - Location of camera. Don't change unless you are sure!!
-	glm::vec3 eye ( 5*cos(camera_rotation_angle*M_PI/180.0f), 0, 5*sin(camera_rotation_angle*M_PI/180.0f) );
-	// Target - Where is the camera looking at.  Don't change unless you are sure!!
-	glm::vec3 target (0, 0, 0);
-	// Up - Up vector defines tilt of camera.  Don't change unless you are sure!!
-	glm::vec3 up (0, 1, 0);
+		}
+		if (gaga==1)
+		{
+		//			gaga=0;
+		flag = 1;
+		//t=curr_t-start_t;
+		//bx+=pos_x;
+		//by+=pos_y;
+		//pos_x=u*cos(DEG2RAD(180))*t*0.01;
+		//pos_y=u*sin(canon_rotation)*t - 0.5*9.8*t*t;
+		//			t=curr_t - start_t;
 
-	// Compute Camera matrix (view)
-	// Matrices.view = glm::lookAt( eye, target, up ); // Rotating Camera for 3D
-	//  Don't change unless you are sure!!
-	Matrices.view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
+		//pos_y -= 0.5*9.8*t*t;
+		//bx += pos_x;
+		//by += pos_y;
+		cout <<"lalallalalala" << endl;
+		cout << bx << endl;
+		cout << by << endl;
+		cout << pos_x << endl;
+		cout << pos_y << endl;
+		angle = 180;		
 
-	// Compute ViewProject matrix as view/camera might not be changed for this frame (basic scenario)
-	//  Don't change unless you are sure!!
-	glm::mat4 VP = Matrices.projection * Matrices.view;
+		pos_x=u*(cos(DEG2RAD(angle)))*t;
+		//		if (by>-7.25)
+		pos_y=u*(sin(DEG2RAD(angle)))*t - 0.5*9.8*t*t;
+		//			pos_x=-u*cos(DEG2RAD(canon_rotation))*t;
+		//			pos_y =( u*sin(DEG2RAD(canon_rotation)) - (0.5*9.8*t*t));
+		//bx+=pos_x;
+		//by+=pos_y;
 
-	// Send our transformation to the currently bound shader, in the "MVP" uniform
-	// For each model you render, since the MVP will be different (at least the M part)
-	//  Don't change unless you are sure!!
-	glm::mat4 MVP;	// MVP = Projection * View * Model
+		cout << "final bx" << bx << endl;
+		cout << "final by" << by << endl;
 
-	// Load identity to model matrix
-	Matrices.model = glm::mat4(1.0f);
+		}
 
-	/* Render your scene */
+		 */
+	}
+	if(!flag)
+	{
+		if (flag_f==1)
+		{
+			if (ay<4.0)
+				//		arrowy+=0.25;
+				ay+=0.05;
 
+			//cout << ay << endl;
+			u+=0.2;
+		}
+		if (flag_s==1 && u>=0.2){
+			if (ay>0)
+				ay-=0.05;
+			u-=0.2;
+			//cout << ay << endl;
+		}
+	}
 
-	Matrices.model = glm::mat4(1.0f);
-	MVP = VP * Matrices.model;
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	draw3DObject(sky);
+	// Increment angles
+	float increments = 1;
 
-	Matrices.model = glm::mat4(1.0f);
-	MVP = VP * Matrices.model;
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	draw3DObject(speedbar);
+	//camera_rotation_angle++; // Simulating camera rotation
+	triangle_rotation = triangle_rotation + increments*triangle_rot_dir*triangle_rot_status;
+	rectangle_rotation = rectangle_rotation + increments*rectangle_rot_dir*rectangle_rot_status;
+	canon_rotation = canon_rotation + increments*canon_rot_dir*canon_rot_status;
+}
 
-	Matrices.model = glm::mat4(1.0f);
-	MVP = VP * Matrices.model;
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	draw3DObject(ground);
+/* Copy what render() needs from the game state */
+void fillSnapshot (FrameSnapshot& frame)
+{
+	frame.lx = lx;
+	frame.rx = rx;
+	frame.dy = dy;
+	frame.upy = upy;
+	frame.fb_width = fb_width;
+	frame.fb_height = fb_height;
+	frame.canon_rotation = canon_rotation;
+	frame.ay = ay;
+	frame.t1 = t1;
+	frame.t2 = t2;
+	frame.t3 = t3;
+	frame.flag = flag;
+	frame.ball_visible = ball_visible;
+	frame.ball_x = ball_x;
+	frame.ball_y = ball_y;
+	frame.score = score;
+	frame.triangle_rotation = triangle_rotation;
+	frame.rectangle_rotation = rectangle_rotation;
+	frame.pacing_mode = pacing_mode;
+	frame.target_fps = target_fps;
+	frame.tick = sim_tick;
+	frame.time = glfwGetTime();
+	frame.after_idle = resumed_from_idle;
+}
 
-	Matrices.model = glm::mat4(1.0f);
-	MVP = VP * Matrices.model;
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	draw3DObject(fly);
+/* Render the scene with openGL */
+/* Queue the draws of every object in the frame */
+void submitScene (const FrameSnapshot& frame)
+{
+	PROFILE_ZONE("build draw list");
+	HwCounterScope hw_counters(HW_DRAW_LIST);
+	submitDraw(LAYER_SKY, sky, glm::mat4(1.0f));
+	submitDraw(LAYER_BACKGROUND, speedbar, glm::mat4(1.0f));
+	submitDraw(LAYER_BACKGROUND, ground, glm::mat4(1.0f));
+	submitDraw(LAYER_PROPS, fly, glm::mat4(1.0f));
 
 	Matrices.model = glm::mat4(1.0f);
 	glm::mat4 translateStick = glm::translate (glm::vec3(13, -6, 0));        // glTranslatef
 	Matrices.model *= translateStick;
-	MVP = VP * Matrices.model;
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	draw3DObject(stick);
+	submitDraw(LAYER_PROPS, stick, Matrices.model);
 
 	/*	Matrices.model = glm::mat4(1.0f);
 		glm::mat4 translateArrow = glm::translate (glm::vec3(-12.5, 0.25 + arrowy, 0));        // glTranslatef
@@ -1042,18 +3706,14 @@ void draw ()
 	//	while (x<5)
 	//		x++;
 	Matrices.model *= translateStand;
-	MVP = VP * Matrices.model;
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	draw3DObject(stand);
+	submitDraw(LAYER_PROPS, stand, Matrices.model);
 
 
 	Matrices.model = glm::mat4(1.0f);
 	glm::mat4 translateTriangle = glm::translate (glm::vec3(-2.0f, 0.0f, 0.0f)); // glTranslatef
-	glm::mat4 rotateTriangle = glm::rotate((float)(triangle_rotation*M_PI/180.0f), glm::vec3(0,0,1));  // rotate about vector (1,0,0)
+	glm::mat4 rotateTriangle = glm::rotate((float)(frame.triangle_rotation*M_PI/180.0f), glm::vec3(0,0,1));  // rotate about vector (1,0,0)
 	glm::mat4 triangleTransform = translateTriangle * rotateTriangle;
 	Matrices.model *= triangleTransform; 
-	MVP = VP * Matrices.model; // MVP = p * V * M
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
 
 	//  Don't change unless you are sure!!
 	//draw3DObject(triangle);
@@ -1063,9 +3723,7 @@ void draw ()
 	//glm::mat4 rotateTriangle = glm::rotate((float)(triangle_rotation*M_PI/180.0f), glm::vec3(0,0,1));  // rotate about vector (1,0,0)
 	glm::mat4 triangle1Transform = translateTriangle1;
 	Matrices.model *= triangle1Transform; 
-	MVP = VP * Matrices.model; // MVP = p * V * M
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	draw3DObject(triangle1);
+	submitDraw(LAYER_PROPS, triangle1, Matrices.model);
 
 
 	Matrices.model = glm::mat4(1.0f);
@@ -1073,9 +3731,7 @@ void draw ()
 	//glm::mat4 rotateTriangle = glm::rotate((float)(triangle_rotation*M_PI/180.0f), glm::vec3(0,0,1));  // rotate about vector (1,0,0)
 	glm::mat4 triangle2Transform = translateTriangle2;
 	Matrices.model *= triangle2Transform; 
-	MVP = VP * Matrices.model; // MVP = p * V * M
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	draw3DObject(triangle2);
+	submitDraw(LAYER_PROPS, triangle2, Matrices.model);
 	// draw3DObject draws the VAO given to it using current MVP matrix
 	//draw3DObject(triangle);
 
@@ -1084,10 +3740,8 @@ void draw ()
 	Matrices.model = glm::mat4(1.0f);
 
 	glm::mat4 translateRectangle = glm::translate (glm::vec3(2, 0, 0));        // glTranslatef
-	glm::mat4 rotateRectangle = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
+	glm::mat4 rotateRectangle = glm::rotate((float)(frame.rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
 	Matrices.model *= (translateRectangle * rotateRectangle);
-	MVP = VP * Matrices.model;
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
 
 	// draw3DObject draws the VAO given to it using current MVP matrix
 	//draw3DObject(rectangle);
@@ -1097,276 +3751,786 @@ void draw ()
 	glm::mat4 translateCircle = glm::translate (glm::vec3(-12, -6.50, 0));        // glTranslatef
 	//glm::mat4 rotateRectangle = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
 	Matrices.model *= translateCircle;
-	MVP = VP * Matrices.model;
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	draw3DObject(circle);
+	submitCircle(LAYER_PROPS, circle, Matrices.model);
 
 
 	Matrices.model = glm::mat4(1.0f);
 	glm::mat4 translateTarget1 = glm::translate (glm::vec3(0, -3.25, 0));        // glTranslatef
 	//glm::mat4 rotateRectangle = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
 	Matrices.model *= translateTarget1;
-	MVP = VP * Matrices.model;
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	if(t1==1)
+	if(frame.t1==1)
 	{
-		draw3DObject(target1);
+		submitCircle(LAYER_TARGETS, target1, Matrices.model);
 	}
 
 	Matrices.model = glm::mat4(1.0f);
 	glm::mat4 translateTarget2 = glm::translate (glm::vec3(8, -5, 0));        // glTranslatef
 	//glm::mat4 rotateRectangle = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
 	Matrices.model *= translateTarget2;
-	MVP = VP * Matrices.model;
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	if (t2==1)
+	if (frame.t2==1)
 	{
-		draw3DObject(target2);
+		submitCircle(LAYER_TARGETS, target2, Matrices.model);
 	}
 
 	Matrices.model = glm::mat4(1.0f);
 	glm::mat4 translateTarget3 = glm::translate (glm::vec3(9,4 , 0));        // glTranslatef
 	//glm::mat4 rotateRectangle = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
 	Matrices.model *= translateTarget3;
-	MVP = VP * Matrices.model;
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	if (t3==1)
+	if (frame.t3==1)
 	{
-		draw3DObject(target3);
+		submitCircle(LAYER_TARGETS, target3, Matrices.model);
 	}
 
-	if (flag==1 || flag==2)
+	if (frame.ball_visible)
 	{
-		gaga=0;
-		haha=0;
-		//ay=0;
-		//	cout<<"boo"<<endl;
 		Matrices.model = glm::mat4(1.0f);
-		bx=can_x + pos_x;
-		by=can_y + pos_y;
-		glm::mat4 translateBall1 = glm::translate (glm::vec3(bx, by, 0));        // glTranslatef
+		glm::mat4 translateBall1 = glm::translate (glm::vec3(frame.ball_x, frame.ball_y, 0));        // glTranslatef
 		Matrices.model *= translateBall1;
+		submitCircle(LAYER_BALLS, ball1, Matrices.model);
+	}
 
-		MVP = VP * Matrices.model;
-		glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-		draw3DObject(ball1);
+	submitDraw(LAYER_CANON, base, glm::mat4(1.0f));
 
-		if(flag == 1)
-		{
-			start_t = glfwGetTime();
-			flag ++;
-				ay=0;
-		}
-		curr_t=glfwGetTime();
-		t=curr_t-start_t;
-		//theta=canon_rotation;
-		//	cout << pos_x << endl;
-		//	cout << pos_y << endl;
-		//		draw3DObject(ball1);
-		/*	if (gaga==1)
-			pos_x=-1*u*(cos(DEG2RAD(angle)))*t;
-			else*/
-		pos_x=u*(cos(DEG2RAD(angle)))*t;
+	Matrices.model = glm::mat4(1.0f);
 
-		if (by>-7.25)
-			pos_y=u*(sin(DEG2RAD(angle)))*t - 0.5*9.8*t*t;
-		if (bx>16.0 || by<-8.0 || by>8.0 || bx<-16.0)
-		{
-			//		cout<<"yo"<<endl;
-			flag=0;
-			u=5;
-			pos_x=0;
-			pos_y=0;
-			//	start_t=glfwGetTime();
-		}
-		if (by<=-7.25 )
-		{
-			int lala;
-			lala=u - 0.1*9.8*t;
+	glm::mat4 translateArrow = glm::translate (glm::vec3(-12.5, frame.ay + 0.5, 0));        // glTranslatef
+	Matrices.model *= translateArrow;
+	submitDraw(LAYER_HUD, arrow, Matrices.model);
 
-			//	cout << "this";
-			//	cout << by << endl;
-			by=pos_y;
-			pos_x=u*cos(DEG2RAD(0))*t - 0.5*0.1*9.8*t*t;
-			//	cout << "u";
-			//	cout << lala << endl;
-			if (lala<-.02)
-			{
-				bx=19.0;
-				by=-10;
-				pos_x=0;
-				pos_y=0;
-			}
 
-		}
-		if( (((bx)*(bx) +(by+3.25)*(by+3.25))*((bx)*(bx) +(by+3.25)*(by+3.25))) <=1.5625   )
-		{
-			if (t1=1)
-				score1=1;
-			t1=0;
+	Matrices.model = glm::mat4(1.0f);
 
-			//score+=1;
-			//cout << score << endl;
-		}
-		if( bx>6.75 && bx<9.25 && by<-3.75 && by>-6.25)
-		{
-			if (t2=1)
-				score2=1;
-			t2=0;
-			//score+=1;
-			//cout << score << endl; 
-		}
-		if( (((bx-9)*(bx-9) +(by-4)*(by-4))*((bx-9)*(bx-9) +(by-4)*(by-4))) <=1.5625   )
-		{
-			if (t3=1)
-				score3=1;
-			t3=0;
-			//score+=1;
-			//cout << score;
+	glm::mat4 translateCanon = glm::translate (glm::vec3(-12, -6.5, 0));      
+	glm::mat4 rotateCanon = glm::rotate((float)(frame.canon_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
+	Matrices.model *= (translateCanon * rotateCanon);
+	submitDraw(LAYER_CANON, canon, Matrices.model);
+}
+
+/* Only reads the snapshot, so it can run on another thread than update() */
+void render (const FrameSnapshot& frame)
+{
+	PROFILE_ZONE("render");
+	frameArena.reset();
+	beginGpuFrame();
+	if (frame.fb_width != viewport_width || frame.fb_height != viewport_height) {
+		// sets the viewport of openGL renderer
+		glViewport (0, 0, (GLsizei) frame.fb_width, (GLsizei) frame.fb_height);
+		viewport_width = frame.fb_width;
+		viewport_height = frame.fb_height;
+	}
+	Matrices.projection = glm::ortho(frame.lx, frame.rx, frame.dy, frame.upy, 0.1f, 500.0f);
+
+	// clear the color and depth in the frame buffer
+	glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+	// Eye - Location of camera. Don't change unless you are sure!!
+	glm::vec3 eye ( 5*cos(camera_rotation_angle*M_PI/180.0f), 0, 5*sin(camera_rotation_angle*M_PI/180.0f) );
+	// Target - Where is the camera looking at.  Don't change unless you are sure!!
+	glm::vec3 target (0, 0, 0);
+	// Up - Up vector defines tilt of camera.  Don't change unless you are sure!!
+	glm::vec3 up (0, 1, 0);
+
+	// Compute Camera matrix (view)
+	// Matrices.view = glm::lookAt( eye, target, up ); // Rotating Camera for 3D
+	//  Don't change unless you are sure!!
+	Matrices.view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
+
+	// Compute ViewProject matrix as view/camera might not be changed for this frame (basic scenario)
+	//  Don't change unless you are sure!!
+	glm::mat4 VP = Matrices.projection * Matrices.view;
+
+	// Load identity to model matrix
+	Matrices.model = glm::mat4(1.0f);
+
+	/* Render your scene */
+	// Every object is submitted to the render queue, which orders the draws by layer
+	beginRenderQueue(VP, frame.lx, frame.rx, frame.dy, frame.upy);
+	beginStreamFrame();
+
+	submitScene(frame);
+	executeRenderQueue();
+	endStreamFrame();
+}
+
+/* One frame on the calling thread : used by --bench */
+void draw ()
+{
+	FrameSnapshot frame;
+	update();
+	fillSnapshot(frame);
+	render(frame);
+}
+
+/* Set the swap interval for the pacing mode, the context must be current */
+void applyFramePacing (int mode, double fps)
+{
+	int interval = 0;
+	if (mode == PACING_VSYNC)
+		interval = 1;
+	else if (mode == PACING_ADAPTIVE) {
+		if (glfwExtensionSupported("GLX_EXT_swap_control_tear") || glfwExtensionSupported("WGL_EXT_swap_control_tear"))
+			interval = -1;
+		else {
+			cout << "Adaptive vsync not supported, using vsync" << endl;
+			interval = 1;
 		}
-		score=score1+score2+score3;
-		//int haha=0;
-		if (score==3)
-		{
-			over=1;
+	}
+	glfwSwapInterval(interval);
+	cout << "Frame pacing : " << pacing_names[mode];
+	if (mode == PACING_LIMIT)
+		cout << " " << fps << " fps";
+	cout << endl;
+}
+
+long long monotonicNanoseconds ()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec*1000000000LL + now.tv_nsec;
+}
+
+/* Frame limiter : sleep until shortly before the deadline, then spin the rest,
+   as sleeps can overshoot by a scheduler tick but spinning is precise */
+void limitFrameRate (double fps)
+{
+	static long long deadline = 0;
+	const long long spin = 1500000; // last 1.5 ms are spun
+	long long period = (long long) (1000000000.0 / fps);
+	long long now = monotonicNanoseconds();
+
+	deadline += period;
+	// More than a frame late (or first frame) : start over instead of rushing to catch up
+	if (deadline < now - period || deadline > now + period)
+		deadline = now + period;
+
+	if (deadline - now > spin) {
+		long long wake = deadline - spin;
+		struct timespec ts;
+		ts.tv_sec = wake / 1000000000LL;
+		ts.tv_nsec = wake % 1000000000LL;
+#ifdef __linux__
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+#else
+		long long delay = wake - now;
+		ts.tv_sec = delay / 1000000000LL;
+		ts.tv_nsec = delay % 1000000000LL;
+		nanosleep(&ts, NULL);
+#endif
+	}
+	while (monotonicNanoseconds() < deadline)
+		;
+}
+
+/* Render stats overlay : the last frame's counts in the window title,
+   refreshed twice a second. Titles can only be set from the main thread. */
+void updateStatsOverlay (GLFWwindow* window)
+{
+	static double last_update = 0;
+	static bool shown = false;
+	if (!show_stats) {
+		if (shown)
+			glfwSetWindowTitle(window, window_title);
+		shown = false;
+		return;
+	}
+	double now = glfwGetTime();
+	if (shown && now - last_update < 0.5)
+		return;
+
+	RenderStats stats = getRenderStats();
+	char title[256];
+	snprintf(title, sizeof(title), "%s - %d draws, %d vertices, %d state changes, %d uniforms, %lld bytes uploaded",
+			window_title, stats.DrawCalls, stats.Vertices, stats.StateChanges, stats.UniformUploads, stats.BytesUploaded);
+	glfwSetWindowTitle(window, title);
+	last_update = now;
+	shown = true;
+}
+
+/* Executed when the window contents are damaged and must be redrawn */
+void refreshWindow (GLFWwindow* window)
+{
+	redraw_requested = true;
+}
+
+/* True if the two snapshots draw the same frame */
+bool sameScene (const FrameSnapshot& a, const FrameSnapshot& b)
+{
+	return a.lx == b.lx && a.rx == b.rx && a.dy == b.dy && a.upy == b.upy
+		&& a.fb_width == b.fb_width && a.fb_height == b.fb_height
+		&& a.canon_rotation == b.canon_rotation && a.ay == b.ay
+		&& a.t1 == b.t1 && a.t2 == b.t2 && a.t3 == b.t3
+		&& a.flag == b.flag && a.ball_visible == b.ball_visible
+		&& a.ball_x == b.ball_x && a.ball_y == b.ball_y
+		&& a.pacing_mode == b.pacing_mode && a.target_fps == b.target_fps;
+}
+
+/* True while an input makes update() change the scene every tick */
+bool inputActive ()
+{
+	return rot_a || rot_b || canon_rot_status || flag_f || flag_s
+		|| up || down || scroll_zoom
+		|| panleft || panright || (right_click && (scroll_left || scroll_right));
+}
+
+/* Idle when no ball is flying, no input is held and the scene is the one
+   last handed to the renderer. The main loop then sleeps in
+   glfwWaitEventsTimeout, which returns as soon as an input event arrives. */
+bool isIdle (const FrameSnapshot& last_published)
+{
+	FrameSnapshot current;
+	fillSnapshot(current);
+	return !redraw_requested && flag == 0 && inputQueue.empty() && held_release_count == 0 && !inputActive()
+		&& sameScene(current, last_published);
+}
+
+/* Lock free single producer / single consumer triple buffer.
+   The writer fills back(), publish() swaps it with the middle slot; the
+   reader's consume() swaps the middle slot with front() when a new one
+   was published. Neither side ever waits for the other, and the reader
+   always gets the latest complete slot. */
+template <typename T>
+struct TripleBuffer {
+	static const int NEW = 4; // set in Middle when it holds an unread slot
+
+	T Slots[3];
+	std::atomic<int> Middle;
+	int Back;  // writer's slot
+	int Front; // reader's slot
+
+	TripleBuffer () : Middle(1), Back(2), Front(0) {}
+
+	T& back () { return Slots[Back]; }
+	const T& front () const { return Slots[Front]; }
+
+	void publish ()
+	{
+		Back = Middle.exchange(Back | NEW, std::memory_order_acq_rel) & 3;
+	}
+
+	bool hasNew () const
+	{
+		return (Middle.load(std::memory_order_acquire) & NEW) != 0;
+	}
+
+	bool consume ()
+	{
+		if (!hasNew())
+			return false;
+		Front = Middle.exchange(Front, std::memory_order_acq_rel) & 3;
+		return true;
+	}
+};
+
+/* Ticks per second of update(), camera and cannon speeds are per tick */
+#define SIM_TICK_RATE 60
+
+/* The render thread owns the GL context : it draws the latest snapshot and
+   swaps, so slow swaps never hold up input polling and update() */
+TripleBuffer<FrameSnapshot> frameHandoff;
+
+/* Flight recorder : the last FLIGHT_FRAMES frames of the render thread,
+   with the profiler zones kept in its ring meanwhile. A frame taking
+   longer than Budget times the median frame is a spike. FLIGHT_AFTER
+   frames later, the recorded window around it is written to
+   flight-N.json, from a separate thread so the write is not a hitch of
+   its own. */
+#define FLIGHT_FRAMES 512 // about 8 s at 60 Hz
+#define FLIGHT_AFTER 60   // frames recorded after the spike before the dump
+
+struct FlightFrame {
+	long long Start;   // render thread began the frame
+	double FrameMs;    // since the previous frame began
+	double RenderMs;   // building and submitting the draws
+	double SwapMs;
+	int Draws;         // draw calls
+	int StateCalls;    // GL state calls issued
+	int BallsAlive;
+	int Allocations;   // on the render thread
+	unsigned int Tick; // simulation tick shown
+};
+
+/* Copy of the recorder and profiler rings, handed to the writer thread */
+struct FlightDump {
+	string Path;
+	long long Spike;   // Start of the spike frame
+	double SpikeMs, MedianMs;
+	vector<FlightFrame> Frames;
+	vector<ProfileEvent> Zones;
+	vector<int> ZoneThreads; // thread id of each zone
+	vector<ProfileCounter> Counters;
+	vector<int> CounterThreads;
+	vector<int> ThreadIds;
+	vector<const char*> ThreadNames;
+};
+
+struct FlightRecorder {
+	bool Enabled;
+	double Budget;          // spike threshold, in multiples of the median frame time
+	FlightFrame Frames[FLIGHT_FRAMES];
+	unsigned int Count;     // frames recorded, the newest is Frames[(Count-1) % FLIGHT_FRAMES]
+	double MedianMs;        // 0 until enough frames were seen
+	long long LastStart;
+	bool SpikePending;      // a spike was seen, its dump waits for the frames after it
+	unsigned int SpikeCount; // Count just after the spike frame
+	int Dumps;              // files written, numbers the next one
+	int Skipped;            // spikes not dumped because the previous dump was still being written
+	std::thread Writer;
+	std::atomic<bool> Writing;
+} flightRecorder;
+
+void startFlightRecorder (double budget)
+{
+	FlightRecorder& fr = flightRecorder;
+	fr.Enabled = true;
+	fr.Budget = budget;
+	fr.Count = 0;
+	fr.MedianMs = 0;
+	fr.SpikePending = false;
+	fr.Dumps = 0;
+	fr.Skipped = 0;
+
+	// Zones go to the profiler ring whenever there is no capture
+	profiler.Ring = true;
+	if (!profiler.Capturing) {
+		profiler.Origin = profileNow();
+		profiler.Enabled = true;
+	}
+}
+
+void writeFlightDump (FlightDump dump)
+{
+	TraceWriter trace;
+	if (trace.open(dump.Path.c_str(), dump.Frames.empty() ? dump.Spike : dump.Frames[0].Start)) {
+		for (size_t i=0; i<dump.ThreadIds.size(); i++)
+			trace.threadName(dump.ThreadIds[i], dump.ThreadNames[i]);
+		for (size_t i=0; i<dump.Zones.size(); i++)
+			trace.zone(dump.Zones[i], dump.ZoneThreads[i]);
+		for (size_t i=0; i<dump.Counters.size(); i++)
+			trace.counter(dump.Counters[i].Name, dump.CounterThreads[i], dump.Counters[i].Time, dump.Counters[i].Value, dump.Counters[i].Unit);
+
+		// Frame records go on a track of their own
+		trace.threadName(0, "frames");
+		for (size_t i=0; i<dump.Frames.size(); i++) {
+			const FlightFrame& f = dump.Frames[i];
+			trace.counter("frame", 0, f.Start, f.FrameMs, "ms");
+			trace.counter("render", 0, f.Start, f.RenderMs, "ms");
+			trace.counter("swap", 0, f.Start, f.SwapMs, "ms");
+			trace.counter("draws", 0, f.Start, f.Draws, "count");
+			trace.counter("state calls", 0, f.Start, f.StateCalls, "count");
+			trace.counter("balls alive", 0, f.Start, f.BallsAlive, "count");
+			trace.counter("allocations", 0, f.Start, f.Allocations, "count");
+			trace.counter("tick", 0, f.Start, f.Tick, "count");
 		}
+		trace.instant("spike", 0, dump.Spike);
+		trace.close();
+		cout << "Frame spike of " << dump.SpikeMs << " ms (median " << dump.MedianMs
+			<< " ms), flight record written to " << dump.Path << endl;
+	}
+	flightRecorder.Writing = false;
+}
 
-		if ((bx >=-2 && bx<=1 && by<=-4 && by>=-6) || (by>=2.75 && by<=3.25 && bx>=7 && bx<=11) || (bx>=12 && bx<=13 && by >=-6 && by<=-2))
-		{
-			if (haha=0)
-			{	can_x=0;
-				can_y=0;
-				start_t=glfwGetTime();
-				haha=1;
+/* Copy both rings and write them out in the background */
+void dumpFlightRecord ()
+{
+	FlightRecorder& fr = flightRecorder;
+	if (fr.Writing) {
+		fr.Skipped++;
+		return;
+	}
+	if (fr.Writer.joinable())
+		fr.Writer.join();
+
+	AllowAllocScope allow_alloc;
+	FlightDump dump;
+	char path[64];
+	snprintf(path, sizeof(path), "flight-%d.json", fr.Dumps++);
+	dump.Path = path;
+	const FlightFrame& spike = fr.Frames[(fr.SpikeCount-1) % FLIGHT_FRAMES];
+	dump.Spike = spike.Start;
+	dump.SpikeMs = spike.FrameMs;
+	dump.MedianMs = fr.MedianMs;
+	unsigned int first = fr.Count > FLIGHT_FRAMES ? fr.Count - FLIGHT_FRAMES : 0;
+	for (unsigned int i=first; i<fr.Count; i++)
+		dump.Frames.push_back(fr.Frames[i % FLIGHT_FRAMES]);
+	long long from = dump.Frames[0].Start;
+
+	{
+		std::lock_guard<std::mutex> lock(profiler.Lock);
+		for (size_t t=0; t<profiler.Threads.size(); t++) {
+			ProfileThread& thread = *profiler.Threads[t];
+			std::lock_guard<std::mutex> thread_lock(thread.Lock);
+			if (thread.Name != NULL) {
+				dump.ThreadIds.push_back(thread.Id);
+				dump.ThreadNames.push_back(thread.Name);
 			}
-			curr_t=glfwGetTime();
-			//	t=curr_t-start_t;
-			//can_x=0
-			pos_x=-1*u*cos(DEG2RAD(angle))*t;
-			pos_y=u*(sin(DEG2RAD(angle)))*t - 0.5*9.8*t*t;
-			gaga=1;
+			for (size_t e=0; e<thread.Events.size(); e++)
+				if (thread.Events[e].End >= from) {
+					dump.Zones.push_back(thread.Events[e]);
+					dump.ZoneThreads.push_back(thread.Id);
+				}
+			for (size_t c=0; c<thread.Counters.size(); c++)
+				if (thread.Counters[c].Time >= from) {
+					dump.Counters.push_back(thread.Counters[c]);
+					dump.CounterThreads.push_back(thread.Id);
+				}
 		}
-		/*	if (bx>=-2 && bx<=1 && by>=-6 && by<=-4)
-			{
-			can_x=bx;
-			can_y=by;
-		//draw3Dobject(ball1);
-		curr_t = glfwGetTime();
-		start_t = glfwGetTime();
-		t=curr_t - start_t;
+	}
 
-		pos_x = u*cos(DEG2RAD(canon_rotation))*t;
-		pos_y = u*sin(DEG2RAD(canon_rotation))*t - 0.5*9.8*t*t;
+	fr.Writing = true;
+	fr.Writer = std::thread(writeFlightDump, std::move(dump));
+}
 
-		u*=1;
-		}
-		 */
+/* Called by the render thread once a frame is swapped */
+void recordFlightFrame (const FrameSnapshot& frame, long long start, long long render_end, long long swap_end)
+{
+	FlightRecorder& fr = flightRecorder;
+	if (!fr.Enabled)
+		return;
+
+	FlightFrame& f = fr.Frames[fr.Count % FLIGHT_FRAMES];
+	f.Start = start;
+	f.FrameMs = fr.Count > 0 ? (start - fr.LastStart)/1e6 : 0;
+	f.RenderMs = (render_end - start)/1e6;
+	f.SwapMs = (swap_end - render_end)/1e6;
+	RenderStats stats = getRenderStats();
+	f.Draws = stats.DrawCalls;
+	f.StateCalls = stats.StateChanges;
+	f.Allocations = stats.Allocations;
+	f.BallsAlive = frame.ball_visible ? 1 : 0;
+	f.Tick = frame.tick;
+	fr.LastStart = start;
+	fr.Count++;
+
+	// The median moves slowly : refresh it every 64 frames, on the whole ring
+	if (fr.Count % 64 == 0) {
+		static double ms[FLIGHT_FRAMES];
+		unsigned int n = min(fr.Count, (unsigned int) FLIGHT_FRAMES);
+		for (unsigned int i=0; i<n; i++)
+			ms[i] = fr.Frames[i].FrameMs;
+		nth_element(ms, ms + n/2, ms + n);
+		fr.MedianMs = ms[n/2];
+	}
 
-		/*		if ( bx>=-1.5 && by>=-6 && by<=-4 && yay!=1)
+	// The first frame after an idle wait did not hitch, nothing was drawn meanwhile
+	if (!fr.SpikePending && !frame.after_idle && fr.MedianMs > 0 && f.FrameMs > fr.Budget*fr.MedianMs) {
+		fr.SpikePending = true;
+		fr.SpikeCount = fr.Count;
+	}
+	if (fr.SpikePending && fr.Count - fr.SpikeCount >= FLIGHT_AFTER) {
+		fr.SpikePending = false;
+		dumpFlightRecord();
+	}
+}
 
-				{
-		//			start_t=glfwGetTime();
-		cout << "GRUEUGRGFUGFRWUGRYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYYU" << endl;
-		cout << bx << endl;
-		cout << by << endl;
-		cout << pos_x << endl;
-		cout << pos_y << endl;
+/* Wait for a dump still being written */
+void stopFlightRecorder ()
+{
+	if (flightRecorder.Writer.joinable())
+		flightRecorder.Writer.join();
+	if (flightRecorder.Skipped > 0)
+		cout << "Flight recorder : " << flightRecorder.Skipped << " spikes not dumped while writing a previous one" << endl;
+}
+struct RenderThread {
+	std::thread Thread;
+	std::atomic<bool> Running;
+	std::mutex WakeMutex; // only to sleep while there is no new snapshot
+	std::condition_variable Wake;
+	int RefreshRate; // of the primary monitor, glfwGetVideoMode only works on the main thread
+} renderThread;
+
+/* Input latency samples on the render side. Only the render thread
+   touches these while it runs; main() reports them after the join.
+   Storage is fixed so the frame loop never allocates : samples wait in
+   a ring of swapped frames for their fence, then only add to a histogram
+   per event type and stage. */
+#define LATENCY_FRAME_SAMPLES 16 // events first shown by one frame, more are dropped
+#define LATENCY_IN_FLIGHT 8      // swapped frames waiting for their fence, more are not timed
+#define LATENCY_STAGES 4         // tick, render, swap, gpu done
+#define LATENCY_BUCKETS 1000     // of LATENCY_BUCKET_MS each, the last one also holds anything slower
+#define LATENCY_BUCKET_MS 0.1
+
+struct LatencyFrame {
+	GLsync Fence;
+	int Count;
+	LatencySample Samples[LATENCY_FRAME_SAMPLES];
+};
 
-		yay = 1;
-		gaga=1;
-		pos_x=0;
-		pos_y=0;
+struct LatencyTracker {
+	LatencyFrame Frame;                        // applied by the snapshot being drawn
+	LatencyFrame InFlight[LATENCY_IN_FLIGHT];  // ring, oldest first
+	int First, InFlightCount;
+	unsigned int Histogram[INPUT_EVENT_TYPES][LATENCY_STAGES][LATENCY_BUCKETS];
+	double MaxMs[INPUT_EVENT_TYPES][LATENCY_STAGES];
+	unsigned int Events[INPUT_EVENT_TYPES];
+	unsigned int Dropped; // past LATENCY_FRAME_SAMPLES or LATENCY_IN_FLIGHT
+} latency;
 
-		can_x=-1.5;
-		can_y=by;
+double latencyStageTime (const LatencySample& sample, int stage);
 
+/* Take the samples applied up to this snapshot's tick : this frame is the first to show them */
+void beginLatencyFrame (const FrameSnapshot& frame)
+{
+	double now = glfwGetTime();
+	const LatencySample* oldest;
+	latency.Frame.Count = 0;
+	while ((oldest = latencyQueue.front()) != NULL && oldest->TickId <= frame.tick) {
+		LatencySample sample;
+		latencyQueue.pop(sample);
+		sample.Render = now;
+		if (latency.Frame.Count < LATENCY_FRAME_SAMPLES)
+			latency.Frame.Samples[latency.Frame.Count++] = sample;
+		else
+			latency.Dropped++;
+	}
+}
+
+/* Called once glfwSwapBuffers returned */
+void endLatencyFrame ()
+{
+	LatencyFrame& frame = latency.Frame;
+	if (frame.Count == 0)
+		return;
+	if (latency.InFlightCount == LATENCY_IN_FLIGHT) {
+		latency.Dropped += frame.Count;
+		return;
+	}
+	double now = glfwGetTime();
+	for (int i=0; i<frame.Count; i++)
+		frame.Samples[i].Swap = now;
+	frame.Fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	latency.InFlight[(latency.First + latency.InFlightCount++) % LATENCY_IN_FLIGHT] = frame;
+}
+
+/* Add a finished sample to the histograms of its event type */
+void recordLatency (const LatencySample& sample)
+{
+	latency.Events[sample.Type]++;
+	for (int stage=0; stage<LATENCY_STAGES; stage++) {
+		double ms = 1000.0*(latencyStageTime(sample, stage) - sample.Input);
+		int bucket = min(max((int) (ms/LATENCY_BUCKET_MS), 0), LATENCY_BUCKETS - 1);
+		latency.Histogram[sample.Type][stage][bucket]++;
+		latency.MaxMs[sample.Type][stage] = max(latency.MaxMs[sample.Type][stage], ms);
+	}
+}
 
+/* Retire the in flight frames whose fence signalled, waiting up to
+   timeout ns for the oldest. Returns true while frames are left. */
+bool pollLatencyFences (GLuint64 timeout)
+{
+	while (latency.InFlightCount > 0) {
+		LatencyFrame& oldest = latency.InFlight[latency.First];
+		GLenum status = glClientWaitSync(oldest.Fence, timeout ? GL_SYNC_FLUSH_COMMANDS_BIT : 0, timeout);
+		if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+			return true;
+
+		double now = glfwGetTime();
+		for (int i=0; i<oldest.Count; i++) {
+			oldest.Samples[i].Gpu = now;
+			recordLatency(oldest.Samples[i]);
 		}
-		if (gaga==1)
-		{
-		//			gaga=0;
-		flag = 1;
-		//t=curr_t-start_t;
-		//bx+=pos_x;
-		//by+=pos_y;
-		//pos_x=u*cos(DEG2RAD(180))*t*0.01;
-		//pos_y=u*sin(canon_rotation)*t - 0.5*9.8*t*t;
-		//			t=curr_t - start_t;
+		glDeleteSync(oldest.Fence);
+		latency.First = (latency.First + 1) % LATENCY_IN_FLIGHT;
+		latency.InFlightCount--;
+		timeout = 0;
+	}
+	return false;
+}
 
-		//pos_y -= 0.5*9.8*t*t;
-		//bx += pos_x;
-		//by += pos_y;
-		cout <<"lalallalalala" << endl;
-		cout << bx << endl;
-		cout << by << endl;
-		cout << pos_x << endl;
-		cout << pos_y << endl;
-		angle = 180;		
+void dropLatencyFences ()
+{
+	for (int i=0; i<latency.InFlightCount; i++)
+		glDeleteSync(latency.InFlight[(latency.First + i) % LATENCY_IN_FLIGHT].Fence);
+	latency.InFlightCount = 0;
+}
 
-		pos_x=u*(cos(DEG2RAD(angle)))*t;
-		//		if (by>-7.25)
-		pos_y=u*(sin(DEG2RAD(angle)))*t - 0.5*9.8*t*t;
-		//			pos_x=-u*cos(DEG2RAD(canon_rotation))*t;
-		//			pos_y =( u*sin(DEG2RAD(canon_rotation)) - (0.5*9.8*t*t));
-		//bx+=pos_x;
-		//by+=pos_y;
+double latencyStageTime (const LatencySample& sample, int stage)
+{
+	switch (stage) {
+		case 0: return sample.Tick;
+		case 1: return sample.Render;
+		case 2: return sample.Swap;
+		default: return sample.Gpu;
+	}
+}
 
-		cout << "final bx" << bx << endl;
-		cout << "final by" << by << endl;
+/* Upper edge in ms of the bucket holding the given percentile of a histogram of n events */
+double latencyPercentile (const unsigned int* histogram, unsigned int n, int percent)
+{
+	unsigned int rank = (unsigned int) ((unsigned long long) n*percent/100);
+	unsigned int seen = 0;
+	for (int bucket=0; bucket<LATENCY_BUCKETS; bucket++) {
+		seen += histogram[bucket];
+		if (seen > rank)
+			return (bucket + 1)*LATENCY_BUCKET_MS;
+	}
+	return LATENCY_BUCKETS*LATENCY_BUCKET_MS;
+}
 
+/* Input to photon latency percentiles per event type, for each stage an event goes through */
+void reportInputLatency ()
+{
+	static const char* type_names[INPUT_EVENT_TYPES] = { "key", "mouse button", "scroll" };
+	static const char* stage_names[LATENCY_STAGES] = { "tick", "render", "swap", "gpu done" };
+
+	bool any = false;
+	for (int type=0; type<INPUT_EVENT_TYPES; type++)
+		any = any || latency.Events[type] > 0;
+	if (any)
+		cout << "Input latency in ms from the GLFW callback to each stage (percentiles to " << LATENCY_BUCKET_MS << " ms) :" << endl;
+	for (int type=0; type<INPUT_EVENT_TYPES; type++) {
+		unsigned int n = latency.Events[type];
+		for (int stage=0; n > 0 && stage<LATENCY_STAGES; stage++) {
+			const unsigned int* histogram = latency.Histogram[type][stage];
+			cout << "  " << type_names[type] << " " << stage_names[stage]
+				<< " : p50 " << latencyPercentile(histogram, n, 50) << ", p95 " << latencyPercentile(histogram, n, 95)
+				<< ", p99 " << latencyPercentile(histogram, n, 99) << ", max " << latency.MaxMs[type][stage]
+				<< " (" << n << " events)" << endl;
 		}
+	}
+	if (inputQueue.Dropped > 0 || latencyQueue.Dropped > 0 || latency.Dropped > 0)
+		cout << "Input events dropped : " << inputQueue.Dropped
+			<< ", latency samples dropped : " << latencyQueue.Dropped + latency.Dropped << endl;
+}
 
-		 */
+/* True when the pacing mode can present more frames than update() makes snapshots */
+bool pacingOutrunsSim (int mode, double fps)
+{
+	switch (mode) {
+		case PACING_UNCAPPED: return true;
+		case PACING_LIMIT: return fps > SIM_TICK_RATE;
+		default: return renderThread.RefreshRate > SIM_TICK_RATE;
 	}
-	if(!flag)
-	{
-		if (flag_f==1)
-		{
-			if (ay<4.0)
-				//		arrowy+=0.25;
-				ay+=0.05;
+}
 
-			//cout << ay << endl;
-			u+=0.2;
-		}
-		if (flag_s==1 && u>=0.2){
-			if (ay>0)
-				ay-=0.05;
-			u-=0.2;
-			//cout << ay << endl;
-		}
+/* Scene between two ticks : camera, cannon, speed arrow and ball move linearly
+   from the older snapshot to the newer one, the rest is the newer one's */
+void blendSnapshots (const FrameSnapshot& older, const FrameSnapshot& newer, double alpha, FrameSnapshot& shown)
+{
+	shown = newer;
+	if (alpha >= 1)
+		return;
+	float a = (float) alpha;
+	shown.lx = glm::mix(older.lx, newer.lx, a);
+	shown.rx = glm::mix(older.rx, newer.rx, a);
+	shown.dy = glm::mix(older.dy, newer.dy, a);
+	shown.upy = glm::mix(older.upy, newer.upy, a);
+	shown.canon_rotation = glm::mix(older.canon_rotation, newer.canon_rotation, alpha);
+	shown.ay = glm::mix(older.ay, newer.ay, alpha);
+	if (older.ball_visible && newer.ball_visible) {
+		shown.ball_x = glm::mix(older.ball_x, newer.ball_x, alpha);
+		shown.ball_y = glm::mix(older.ball_y, newer.ball_y, alpha);
 	}
+}
 
-	Matrices.model = glm::mat4(1.0f);
-	MVP = VP * Matrices.model;
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	draw3DObject(base);
+/* Draws each new snapshot once. When the pacing mode allows more frames than
+   SIM_TICK_RATE, it keeps drawing between snapshots, blending the two latest
+   ones : the scene then trails update() by one tick but moves at the display rate. */
+void renderThreadMain (GLFWwindow* window)
+{
+	glfwMakeContextCurrent(window);
+	profileNameThread("render");
+
+	int pacing = -1;
+	double fps = 0;
+	unsigned int frames = 0;
+	FrameSnapshot older = FrameSnapshot(), newer = FrameSnapshot(), shown;
+	bool settled = true; // the newest snapshot was drawn unblended
+	while (renderThread.Running.load()) {
+		bool fresh = frameHandoff.consume();
+		if (fresh) {
+			older = newer;
+			newer = frameHandoff.front();
+		}
 
-	Matrices.model = glm::mat4(1.0f);
+		// Blend only ticks in a row, not across an idle wait or a stall
+		double alpha = 1;
+		double interval = newer.time - older.time;
+		if (pacingOutrunsSim(newer.pacing_mode, newer.target_fps) && !newer.after_idle
+				&& interval > 0 && interval < 2.0/SIM_TICK_RATE)
+			alpha = min((glfwGetTime() - newer.time)/interval, 1.0);
+
+		if (!fresh && settled) {
+			// Time the last frames' fences closely rather than on the next wake up
+			if (pollLatencyFences(1000000))
+				continue;
+			std::unique_lock<std::mutex> lock(renderThread.WakeMutex);
+			renderThread.Wake.wait_for(lock, std::chrono::milliseconds(100),
+					[] { return frameHandoff.hasNew() || !renderThread.Running.load(); });
+			continue;
+		}
+		blendSnapshots(older, newer, alpha, shown);
+		shown.after_idle = fresh && newer.after_idle;
+		settled = alpha >= 1;
+		const FrameSnapshot& frame = shown;
+		NoAllocScope no_alloc(++frames > ALLOC_WARMUP_FRAMES);
+
+		if (frame.pacing_mode != pacing || frame.target_fps != fps) {
+			pacing = frame.pacing_mode;
+			fps = frame.target_fps;
+			applyFramePacing(pacing, fps);
+		}
 
-	glm::mat4 translateArrow = glm::translate (glm::vec3(-12.5, ay + 0.5, 0));        // glTranslatef
-	Matrices.model *= translateArrow;
-	MVP = VP * Matrices.model;
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	draw3DObject(arrow);
+		long long frame_start = profileNow();
+		pollLatencyFences(0);
+		beginLatencyFrame(frame);
+		render(frame);
+		stateEndFrame();
+		endRenderStatsFrame();
+		long long render_end = profileNow();
 
+		// Swap Frame Buffer in double buffering
+		{
+			PROFILE_ZONE("swap");
+			glfwSwapBuffers(window);
+		}
+		endLatencyFrame();
+		collectResources();
+		recordFlightFrame(frame, frame_start, render_end, profileNow());
+		if (pacing == PACING_LIMIT) {
+			PROFILE_ZONE("frame limiter");
+			limitFrameRate(fps);
+		}
+	}
+	dropLatencyFences();
 
-	Matrices.model = glm::mat4(1.0f);
+	glfwMakeContextCurrent(NULL);
+}
 
-	glm::mat4 translateCanon = glm::translate (glm::vec3(-12, -6.5, 0));      
-	glm::mat4 rotateCanon = glm::rotate((float)(canon_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-	Matrices.model *= (translateCanon * rotateCanon);
-	MVP = VP * Matrices.model;
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	draw3DObject(canon);
+/* Hand the GL context, current on this thread, over to a new render thread */
+void startRenderThread (GLFWwindow* window)
+{
+	glfwMakeContextCurrent(NULL);
+	const GLFWvidmode* mode = glfwGetVideoMode(glfwGetPrimaryMonitor());
+	renderThread.RefreshRate = mode ? mode->refreshRate : 0;
+	renderThread.Running.store(true);
+	renderThread.Thread = std::thread(renderThreadMain, window);
+}
 
-	// Increment angles
-	float increments = 1;
+void stopRenderThread ()
+{
+	if (!renderThread.Thread.joinable())
+		return;
+	{
+		std::lock_guard<std::mutex> lock(renderThread.WakeMutex);
+		renderThread.Running.store(false);
+	}
+	renderThread.Wake.notify_one();
+	renderThread.Thread.join();
+}
 
-	//camera_rotation_angle++; // Simulating camera rotation
-	triangle_rotation = triangle_rotation + increments*triangle_rot_dir*triangle_rot_status;
-	rectangle_rotation = rectangle_rotation + increments*rectangle_rot_dir*rectangle_rot_status;
-	canon_rotation = canon_rotation + increments*canon_rot_dir*canon_rot_status;
+/* Give the renderer the state after this tick */
+void publishFrame (FrameSnapshot& last_published)
+{
+	FrameSnapshot& frame = frameHandoff.back();
+	fillSnapshot(frame);
+	last_published = frame;
+	{
+		// Empty critical section : the renderer cannot miss the wake up between its check and its wait
+		std::lock_guard<std::mutex> lock(renderThread.WakeMutex);
+		frameHandoff.publish();
+	}
+	renderThread.Wake.notify_one();
 }
 
 /* Initialise glfw window, I/O callbacks and the renderer to use */
@@ -1384,8 +4548,10 @@ GLFWwindow* initGLFW (int width, int height)
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
 	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	if (headless)
+		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
 
-	window = glfwCreateWindow(width, height, "Sample OpenGL 3.3 Application", NULL, NULL);
+	window = glfwCreateWindow(width, height, window_title, NULL, NULL);
 
 	if (!window) {
 		glfwTerminate();
@@ -1394,7 +4560,6 @@ GLFWwindow* initGLFW (int width, int height)
 
 	glfwMakeContextCurrent(window);
 	gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
-	glfwSwapInterval( 1 );
 
 	/* --- register callbacks with GLFW --- */
 
@@ -1407,6 +4572,9 @@ GLFWwindow* initGLFW (int width, int height)
 	/* Register function to handle window close */
 	glfwSetWindowCloseCallback(window, quit);
 
+	/* Register function to redraw damaged window contents while idle */
+	glfwSetWindowRefreshCallback(window, refreshWindow);
+
 	/* Register function to handle keyboard input */
 	glfwSetKeyCallback(window, keyboard);      // general keyboard input
 	glfwSetCharCallback(window, keyboardChar);  // simpler specific character handling
@@ -1417,11 +4585,9 @@ GLFWwindow* initGLFW (int width, int height)
 	return window;
 }
 
-/* Initialize the OpenGL rendering properties */
 /* Add all the models to be created here */
-void initGL (GLFWwindow* window, int width, int height)
+void createSceneMeshes ()
 {
-	/* Objects should be created before any other gl function and shaders */
 	// Create the models
 	//createTriangle (); // Generate the VAO, VBOs, vertices data & copy into the array buffer
 	//createRectangle ();
@@ -1451,12 +4617,48 @@ void initGL (GLFWwindow* window, int width, int height)
 	createTriangle2();
 	createFly();
 	createSpeedbar();
+}
+
+/* Release the scene meshes and build them again, as a level change does */
+void reloadSceneMeshes ()
+{
+	MeshHandle* meshes[] = { &circle, &base, &canon, &ground, &sky, &ball1, &stick, &stand,
+		&target1, &target2, &target3, &triangle1, &triangle2, &fly, &arrow, &speedbar };
+	for (size_t i=0; i<sizeof(meshes)/sizeof(meshes[0]); i++)
+		releaseResource(*meshes[i]);
+	createSceneMeshes();
+	staticLayer.Valid = false;
+}
+
+/* Initialize the OpenGL rendering properties */
+void initGL (GLFWwindow* window, int width, int height)
+{
+	/* Objects should be created before any other gl function and shaders */
+	createSceneMeshes();
 	cout << score << endl;
 	// Create and compile our GLSL program from the shaders
-	programID = LoadShaders( "Sample_GL.vert", "Sample_GL.frag" );
+	renderPrograms[PROGRAM_FLAT].Resource = createProgram( "Sample_GL.vert", "Sample_GL.frag" );
+	programID = getResourceName(renderPrograms[PROGRAM_FLAT].Resource);
 	// Get a handle for our "MVP" uniform
 	Matrices.MatrixID = glGetUniformLocation(programID, "MVP");
-	
+
+	renderPrograms[PROGRAM_FLAT].ID = programID;
+	renderPrograms[PROGRAM_FLAT].MatrixID = Matrices.MatrixID;
+	renderPrograms[PROGRAM_FLAT].Blend = false;
+
+	// Program for the SDF circle pipeline, selectable with --sdf
+	renderPrograms[PROGRAM_SDF].Resource = createProgram( "Sample_GL_sdf.vert", "Sample_GL_sdf.frag" );
+	renderPrograms[PROGRAM_SDF].ID = getResourceName(renderPrograms[PROGRAM_SDF].Resource);
+	renderPrograms[PROGRAM_SDF].MatrixID = glGetUniformLocation(renderPrograms[PROGRAM_SDF].ID, "MVP");
+	renderPrograms[PROGRAM_SDF].Blend = true;
+	glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	// Per frame vertex data, 1024 vertices per frame in flight
+	initStreamBuffer(1024);
+
+	initStaticLayer();
+	initGpuTimers();
+
 
 	reshapeWindow (window, width, height);
 
@@ -1473,37 +4675,343 @@ void initGL (GLFWwindow* window, int width, int height)
 	cout << "GLSL: " << glGetString(GL_SHADING_LANGUAGE_VERSION) << endl;
 }
 
+/* Delete every GL object the game made. The context must be current. */
+void destroyRenderer ()
+{
+	destroyResources();
+
+	// Not shared, these are owned by their module rather than by the resource manager
+	glDeleteVertexArrays(1, &streamBuffer.Vao.VertexArrayID);
+	glDeleteFramebuffers(1, &staticLayer.Framebuffer);
+	glDeleteTextures(1, &staticLayer.ColorTexture);
+	glDeleteRenderbuffers(1, &staticLayer.DepthBuffer);
+	glDeleteVertexArrays(1, &staticLayer.VertexArrayID);
+	if (gpuTimers.Supported)
+		glDeleteQueries(GPU_TIMER_LATENCY*GPU_PASS_COUNT, &gpuTimers.Queries[0][0]);
+}
+
+/* Render a screen full of targets with the given circle pipeline, returns ms per frame */
+double benchCirclePipeline (GLFWwindow* window, int pipeline, int frames)
+{
+	int saved_pipeline = circle_pipeline;
+	circle_pipeline = pipeline;
+
+	glm::mat4 VP = glm::ortho(-16.0f, 16.0f, -8.0f, 8.0f, 0.1f, 500.0f) * glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0));
+
+	glFinish();
+	double start = glfwGetTime();
+	for (int frame=0; frame<frames; frame++) {
+		frameArena.reset(); // render() is not called here to do it
+		glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		beginRenderQueue(VP, -16, 16, -8, 8);
+		for (int i=0; i<20; i++)
+			for (int j=0; j<10; j++)
+				submitCircle(LAYER_TARGETS, target1, glm::translate (glm::vec3(-15.2 + 1.6*i, -7.2 + 1.6*j, 0)));
+		executeRenderQueue();
+		glfwSwapBuffers(window);
+	}
+	glFinish();
+	double elapsed = glfwGetTime() - start;
+
+	circle_pipeline = saved_pipeline;
+	return elapsed*1000/frames;
+}
+
+/* Stream a fan of lines through the stream buffer every frame, returns ms per frame */
+double benchStreamBuffer (GLFWwindow* window, int frames)
+{
+	glm::mat4 VP = glm::ortho(-16.0f, 16.0f, -8.0f, 8.0f, 0.1f, 500.0f) * glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0));
+	const int lines = 500;
+
+	glFinish();
+	double start = glfwGetTime();
+	for (int frame=0; frame<frames; frame++) {
+		frameArena.reset();
+		glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		beginRenderQueue(VP, -16, 16, -8, 8);
+		beginStreamFrame();
+		int first;
+		GLfloat* vertex = streamReserve(2*lines, &first);
+		if (vertex != NULL) {
+			// Vertices change every frame, as streamed data does
+			for (int i=0; i<lines; i++) {
+				GLfloat* v = vertex + 12*i;
+				int degrees = (i + frame) % 360;
+				v[0] = 0; v[1] = 0; v[2] = 0;
+				v[3] = 1; v[4] = 1; v[5] = 1;
+				v[6] = 7*cosDeg(degrees); v[7] = 7*sinDeg(degrees); v[8] = 0;
+				v[9] = 0; v[10] = 0; v[11] = 0;
+			}
+			submitDrawRange(LAYER_BALLS, &streamBuffer.Vao, GL_LINES, first, 2*lines, glm::mat4(1.0f));
+		}
+		executeRenderQueue();
+		endStreamFrame();
+		glfwSwapBuffers(window);
+	}
+	glFinish();
+	return (glfwGetTime() - start)*1000/frames;
+}
+
+/* Compare both circle pipelines and print a report, used with --bench */
+void runBench (GLFWwindow* window, int frames)
+{
+	glfwSwapInterval(0);
+
+	// Warm up both programs so shader compilation is not measured
+	benchCirclePipeline(window, CIRCLE_FAN, 5);
+	benchCirclePipeline(window, CIRCLE_SDF, 5);
+
+	double fan = benchCirclePipeline(window, CIRCLE_FAN, frames);
+	double sdf = benchCirclePipeline(window, CIRCLE_SDF, frames);
+	double stream = benchStreamBuffer(window, frames);
+
+	// Game scene, idle cannon : the state cache counts are the same every frame
+	stateEndFrame();
+	endRenderStatsFrame();
+	glFinish();
+	resetGpuTimers();
+	resetHwCounters();
+	double start = glfwGetTime();
+	for (int frame=0; frame<frames; frame++) {
+		NoAllocScope no_alloc(frame >= 10);
+		draw();
+		stateEndFrame();
+		endRenderStatsFrame();
+		PROFILE_ZONE("swap");
+		glfwSwapBuffers(window);
+	}
+	glFinish();
+	double scene = (glfwGetTime() - start)*1000/frames;
+	finishGpuTimers();
+
+	cout << "BENCH circles : 200 per frame, " << frames << " frames" << endl;
+	cout << "BENCH fan : " << fan << " ms/frame (" << (getMesh(target1) ? getMesh(target1)->NumVertices : 0) << " vertices per circle)" << endl;
+	cout << "BENCH sdf : " << sdf << " ms/frame (4 vertices per circle)" << endl;
+	cout << "BENCH scene : " << scene << " ms/frame" << endl;
+	RenderStats stats = getRenderStats();
+	cout << "BENCH render stats : " << stats.DrawCalls << " draw calls, " << stats.Vertices << " vertices, "
+		<< stats.StateChanges << " state changes, " << stats.UniformUploads << " uniform uploads, "
+		<< stats.BytesUploaded << " bytes uploaded per frame" << endl;
+	cout << "BENCH frame arena : " << frameArena.HighWater << " bytes used at most, " << frameArena.Size << " bytes reserved" << endl;
+	cout << "BENCH meshes : " << meshRegistry.Created << " created, " << meshRegistry.Meshes.size() << " uploaded, "
+		<< meshRegistry.BytesShared << " bytes shared" << endl;
+	cout << "BENCH geometry staging : " << stagingArena.HighWater << " bytes used at most, " << stagingArena.Size << " bytes reserved" << endl;
+	cout << "BENCH allocations : " << stats.Allocations << " (" << stats.AllocatedBytes << " bytes) per frame" << endl;
+	cout << "BENCH gl state calls : " << glState.LastIssued << " issued, " << glState.LastElided << " elided per frame" << endl;
+	cout << "BENCH culling : " << renderQueue.Culled << " of " << renderQueue.Submitted << " draws culled" << endl;
+	cout << "BENCH static layer : " << (staticLayer.Enabled ? "cached" : "off") << ", " << staticLayer.Redraws << " redraws" << endl;
+	cout << "BENCH stream buffer : " << stream << " ms/frame for 1000 streamed vertices, "
+		<< (streamBuffer.Persistent ? "persistent mapped" : "orphaned") << ", " << streamBuffer.Stalls << " stalls" << endl;
+	if (!gpuTimers.Supported)
+		cout << "BENCH gpu passes : timer queries not supported" << endl;
+	for (int pass=0; gpuTimers.Supported && pass<GPU_PASS_COUNT; pass++)
+		if (gpuTimers.Samples[pass] > 0)
+			cout << "BENCH " << gpu_pass_names[pass] << " : " << gpuTimers.TotalMs[pass]/gpuTimers.Samples[pass]
+				<< " ms/frame over " << gpuTimers.Samples[pass] << " frames" << endl;
+	for (int section=0; hwCounters.Enabled && section<HW_SECTIONS; section++) {
+		const HwSectionStats& stats = hwCounters.Sections[section];
+		if (stats.Samples == 0)
+			continue;
+		cout << "BENCH perf " << hw_section_names[section] << " per frame :";
+		const char* separator = " ";
+		for (int c=0; c<HW_COUNTERS; c++)
+			if (hwCounters.Supported[c]) {
+				cout << separator << stats.Total[c]/stats.Samples << " " << hw_counter_names[c];
+				separator = ", ";
+			}
+		if (hwCounters.Supported[HW_CYCLES] && hwCounters.Supported[HW_INSTRUCTIONS] && stats.Total[HW_CYCLES] > 0)
+			cout << separator << "IPC " << (double) stats.Total[HW_INSTRUCTIONS]/stats.Total[HW_CYCLES];
+		cout << endl;
+	}
+	if (gpuTimers.Missed > 0)
+		cout << "BENCH gpu timers : " << gpuTimers.Missed << " results not ready in time, dropped" << endl;
+
+	cout << "BENCH gpu memory :";
+	for (int kind=0; kind<RESOURCE_KINDS; kind++)
+		cout << (kind ? ", " : " ") << resources.Live[kind] << " " << resource_kind_names[kind] << " (" << resources.LiveBytes[kind] << " bytes)";
+	cout << endl;
+
+	// Level changes : once the released meshes are collected, GPU memory is back where it was
+	size_t live = resources.LiveBytes[RESOURCE_MESH];
+	int deleted = resources.Deleted;
+	for (int frame=0; frame<100; frame++) {
+		frameArena.reset();
+		reloadSceneMeshes();
+		draw();
+		glfwSwapBuffers(window);
+		collectResources();
+	}
+	glFinish();
+	collectResources();
+	cout << "BENCH scene reloads : 100, mesh memory " << live << " -> " << resources.LiveBytes[RESOURCE_MESH] << " bytes, "
+		<< resources.Deleted - deleted << " objects deleted, " << resources.PendingBytes << " bytes pending" << endl;
+
+	// Procedural level load : shapes of every kind and size, all different so
+	// none is shared. First tessellation alone, then the whole createShape path
+	// with its buffer creation, mapping and unmapping.
+	const GLfloat hexagon[12] = { 1, 0, 0.5f, 0.866f, -0.5f, 0.866f, -1, 0, -0.5f, -0.866f, 0.5f, -0.866f };
+	const int shapes = 10000;
+	vector<Shape> level(shapes);
+	vector<GLfloat> points(12*shapes);
+	for (int i=0; i<shapes; i++) {
+		float size = 0.02f + 0.00003f*i;
+		switch (i % 6) {
+			case 0: level[i] = circleShape(size, 1, 0, 0); break;
+			case 1: level[i] = arcShape(0.5f*size, size, 0.1f*(i % 11), 0.1f*(i % 11) + 0.5f + 0.2f*(i % 13), 0, 1, 0); break;
+			case 2: level[i] = ringShape(0.8f*size, size, 0, 0, 1); break;
+			case 3: level[i] = roundedRectShape(4*size, 2*size, 0.5f*size, 1, 1, 0); break;
+			case 4: level[i] = capsuleShape(3*size, size, 0, 1, 1); break;
+			default:
+				for (int p=0; p<12; p++)
+					points[12*i + p] = size*hexagon[p];
+				level[i] = polygonShape(6, &points[12*i], 1, 0, 1);
+				break;
+		}
+	}
+
+	long long vertices = 0;
+	start = glfwGetTime();
+	for (int i=0; i<shapes; i++) {
+		StagingScope staging;
+		int n = shapeVertexCount(level[i]);
+		tessellateShape(level[i], stagingArena.allocArray<PackedVertex>(n));
+		vertices += n;
+	}
+	cout << "BENCH tessellator : " << shapes << " shapes, " << vertices << " vertices in " << (glfwGetTime() - start)*1000 << " ms" << endl;
+
+	vector<MeshHandle> meshes(shapes);
+	int live_meshes = resources.Live[RESOURCE_MESH];
+	glFinish();
+	start = glfwGetTime();
+	for (int i=0; i<shapes; i++)
+		meshes[i] = createShape(level[i]);
+	glFinish();
+	double load = (glfwGetTime() - start)*1000;
+	int created = resources.Live[RESOURCE_MESH] - live_meshes;
+	for (int i=0; i<shapes; i++)
+		releaseResource(meshes[i]);
+	glFinish();
+	collectResources();
+	cout << "BENCH shape meshes : " << shapes << " createShape calls in " << load << " ms, "
+		<< created << " meshes made" << endl;
+}
+
 int main (int argc, char** argv)
 {
 	int width = 1200;
 	int height = 600;
+	int bench_frames = 0;
+
+	profileNameThread("main");
+	staticLayer.Enabled = true;
+
+	for (int i=1; i<argc; i++) {
+		string arg = argv[i];
+		if (arg == "--sdf")
+			circle_pipeline = CIRCLE_SDF;
+		else if (arg == "--no-static-cache")
+			staticLayer.Enabled = false;
+		else if (arg == "--pacing" && i+1 < argc) {
+			string mode = argv[++i];
+			int found = -1;
+			for (int m=0; m<PACING_COUNT; m++)
+				if (mode == pacing_names[m])
+					found = m;
+			if (found < 0) {
+				cerr << "Unknown pacing mode " << mode << ", expected one of :";
+				for (int m=0; m<PACING_COUNT; m++)
+					cerr << " " << pacing_names[m];
+				cerr << endl;
+				exit(EXIT_FAILURE);
+			}
+			pacing_mode = found;
+		}
+		else if (arg == "--fps" && i+1 < argc) {
+			target_fps = max(1.0, atof(argv[++i]));
+			pacing_mode = PACING_LIMIT;
+		}
+		else if (arg == "--bench") {
+			bench_frames = 300;
+			if (i+1 < argc && atoi(argv[i+1]) > 0)
+				bench_frames = atoi(argv[++i]);
+			headless = true;
+		}
+		else if (arg == "--assert-no-alloc")
+			assert_no_alloc = true;
+		else if (arg == "--perf-counters")
+			hwCounters.Enabled = true;
+		else if (arg == "--stats")
+			show_stats = true;
+		else if (arg == "--flight-recorder") {
+			double budget = 2.0;
+			if (i+1 < argc && atof(argv[i+1]) > 1.0)
+				budget = atof(argv[++i]);
+			startFlightRecorder(budget);
+		}
+		else if (arg == "--trace" && i+1 < argc) {
+			trace_path = argv[++i];
+			startProfiling();
+		}
+	}
+
 	//	cout << score << endl;
 	GLFWwindow* window = initGLFW(width, height);
 
 	initGL (window, width, height);
 
-	double last_update_time = glfwGetTime(), current_time;
-	//lala(window);
-	/* Draw in loop */
-	while (!glfwWindowShouldClose(window)) {
+	if (bench_frames > 0) {
+		runBench (window, bench_frames);
+		if (profiler.Capturing)
+			writeChromeTrace(trace_path.c_str());
+		destroyRenderer();
+		glfwTerminate();
+		exit(EXIT_SUCCESS);
+	}
 
-		// OpenGL Draw commands
-		draw();
+	FrameSnapshot last_published;
+	fillSnapshot(last_published);
+	startRenderThread(window);
 
-		// Swap Frame Buffer in double buffering
-		glfwSwapBuffers(window);
+	// update() runs at SIM_TICK_RATE on this thread, which also polls input.
+	// Frames are drawn and swapped by the render thread.
+	const double tick = 1.0 / SIM_TICK_RATE;
+	double next_tick = glfwGetTime();
+	while (!glfwWindowShouldClose(window)) {
+		updateStatsOverlay(window);
+
+		// Nothing moves : wait for input instead of publishing the same frame again
+		if (isIdle(last_published)) {
+			resumed_from_idle = true;
+			glfwWaitEventsTimeout(0.5);
+			next_tick = glfwGetTime();
+			continue;
+		}
 
-		// Poll for Keyboard and mouse events
-		glfwPollEvents();
+		// Poll for Keyboard and mouse events until the next tick is due
+		double now = glfwGetTime();
+		if (now < next_tick) {
+			glfwWaitEventsTimeout(next_tick - now);
+			continue;
+		}
+		next_tick += tick;
+		if (next_tick < now) // too far behind, e.g. after a stall : do not replay the missed ticks
+			next_tick = now + tick;
 
-		// Control based on time (Time based transformation like 5 degrees rotation every 0.5s)
-		current_time = glfwGetTime(); // Time in seconds
-		if ((current_time - last_update_time) >= 0.1) { // atleast 0.5s elapsed since last frame
-			// do something every 0.5 seconds ..
-			last_update_time = current_time;
+		redraw_requested = false;
+		{
+			NoAllocScope no_alloc(sim_tick >= ALLOC_WARMUP_FRAMES);
+			update();
+			publishFrame(last_published);
 		}
-		//		cout << score << endl;
+		resumed_from_idle = false;
 	}
+	stopRenderThread();
+	glfwMakeContextCurrent(window);
+	destroyRenderer();
+	stopFlightRecorder();
+	reportInputLatency();
+	if (profiler.Capturing)
+		writeChromeTrace(trace_path.c_str());
 	//	cout << score << endl;
 
 	glfwTerminate();
@@ -0,0 +1,22 @@
+#version 330 core
+
+// Interpolated values from the vertex shaders
+in vec3 fragColor;
+in vec2 circleCoord;
+
+// output data
+out vec4 color;
+
+void main()
+{
+    // Signed distance to the rim of the unit circle : negative inside
+    float d = length(circleCoord) - 1.0;
+
+    // Smooth the edge over about one pixel for free anti-aliasing
+    float w = fwidth(d);
+    float coverage = 1.0 - smoothstep(-w, w, d);
+    if (coverage <= 0.0)
+        discard;
+
+    color = vec4(fragColor, coverage);
+}
@@ -0,0 +1,27 @@
+#version 330 core
+
+// input data : sent from main program
+// Circles are quads of 4 vertices (triangle strip) whose corners sit at
+// +-SDF_PAD * radius, so the anti-aliased rim is not clipped by the quad
+layout (location = 0) in vec3 vertexPosition;
+layout (location = 1) in vec3 vertexColor;
+
+uniform mat4 MVP;
+
+// output data : used by fragment shader
+out vec3 fragColor;
+out vec2 circleCoord;
+
+const float SDF_PAD = 1.0625;
+
+void main ()
+{
+    // Corner of the quad in circle space (radius 1), in triangle strip order
+    vec2 corners[4] = vec2[4](vec2(-1,-1), vec2(1,-1), vec2(-1,1), vec2(1,1));
+    circleCoord = corners[gl_VertexID % 4] * SDF_PAD;
+
+    fragColor = vertexColor;
+
+    // Output position of the vertex, in clip space : MVP * position
+    gl_Position = MVP * vec4(vertexPosition, 1);
+}
@@ -0,0 +1,15 @@
+#version 330 core
+
+// Interpolated values from the vertex shaders
+in vec2 texCoord;
+
+// Static layer rendered by the main program
+uniform sampler2D staticLayer;
+
+// output data
+out vec3 color;
+
+void main()
+{
+    color = texture(staticLayer, texCoord).rgb;
+}
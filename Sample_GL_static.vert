@@ -0,0 +1,15 @@
+#version 330 core
+
+// No vertex data : a fullscreen quad (triangle strip) is built from gl_VertexID
+
+// output data : used by fragment shader
+out vec2 texCoord;
+
+void main ()
+{
+    vec2 corners[4] = vec2[4](vec2(-1,-1), vec2(1,-1), vec2(-1,1), vec2(1,1));
+    vec2 corner = corners[gl_VertexID % 4];
+
+    texCoord = corner * 0.5 + 0.5;
+    gl_Position = vec4(corner, 0, 1);
+}